@@ -0,0 +1,89 @@
+#!/bin/bash
+
+# Runs the same workloads through every shell implementation built by CMake (each *_bench
+# binary) and prints correctness, throughput, latency and leaks side by side.
+# Correctness is a differential check: short scripts must print exactly what /bin/sh prints -
+# "correct" for plain commands, "heredoc" for a here-document (an extension not every
+# implementation has).
+# Raw JSON results are appended to bench_output.txt.
+# Usage: bench/compare.sh [build-dir] [iterations]
+
+BUILD_DIR="${1:-_gate_build}"
+ITERATIONS="${2:-200}"
+OUTPUT="bench_output.txt"
+WORKLOADS="simple spawn pipe2 redirect_in redirect_out background"
+
+BENCHES=$(ls "$BUILD_DIR"/*_bench 2>/dev/null)
+if [ -z "$BENCHES" ]; then
+    echo "Build first: cmake -S . -B $BUILD_DIR && cmake --build $BUILD_DIR"
+    exit 1
+fi
+# The correctness checks run the shells from the scratch directory
+BUILD_DIR=$(cd "$BUILD_DIR" && pwd)
+
+SCRATCH=$(mktemp -d)
+RESULTS="$SCRATCH/results.jsonl"
+trap 'rm -rf "$SCRATCH"' EXIT
+
+# Correctness scripts and their reference output. Neither ends with a newline, so the last line
+# is only ended by the end of the input - after a longer line, and after a here-document.
+seq 1 20 > "$SCRATCH/input.txt"
+printf '%s' 'echo hello world
+seq 1 5 | sort -r
+head -n 3 < input.txt
+wc -l < input.txt
+ls input.txt
+echo hi' > "$SCRATCH/output.txt"
+printf '%s' 'cat <<EOF
+here-document
+EOF
+echo after' > "$SCRATCH/heredoc.txt"
+for check in output heredoc; do
+    (cd "$SCRATCH" && sh < $check.txt > $check.expected 2>&1)
+done
+
+for bench in $BENCHES; do
+    impl=$(basename "$bench" _bench)
+    shell="$BUILD_DIR/$impl"
+
+    for check in output heredoc; do
+        correct=false
+        if [ -x "$shell" ] && (cd "$SCRATCH" && timeout 10 "$shell" < $check.txt > $check.actual 2>&1) &&
+            cmp -s "$SCRATCH/$check.expected" "$SCRATCH/$check.actual"; then
+            correct=true
+        fi
+        echo "{\"impl\":\"$impl\",\"check\":\"$check\",\"correct\":$correct}" >> "$RESULTS"
+    done
+
+    # One process per workload, so an implementation that exits or crashes only loses that one
+    for workload in $WORKLOADS; do
+        if ! timeout 120 "$bench" -n "$ITERATIONS" -i "$impl" -w "$workload" >> "$RESULTS" 2>/dev/null; then
+            echo "{\"impl\":\"$impl\",\"mode\":\"direct\",\"workload\":\"$workload\",\"failed\":true}" >> "$RESULTS"
+        fi
+    done
+done
+cat "$RESULTS" >> "$OUTPUT"
+
+awk '
+function field(key,    pattern) {
+    pattern = "\"" key "\":[^,}]*"
+    if (!match($0, pattern)) return "-"
+    value = substr($0, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+    gsub(/"/, "", value)
+    return value == "null" ? "-" : value
+}
+/"check":"output"/ { correct[field("impl")] = field("correct") == "true" ? "yes" : "NO"; next }
+/"check":"heredoc"/ { heredoc[field("impl")] = field("correct") == "true" ? "yes" : "no"; next }
+{
+    line = sprintf("%-13s %-13s %-8s %-8s", field("workload"), field("impl"), correct[field("impl")], heredoc[field("impl")])
+    if (field("failed") == "true")
+        line = line sprintf(" %10s", "FAILED")
+    else
+        line = line sprintf(" %10s %9s %9s %8s %6s", field("cmds_per_sec"), field("p50_us"), field("p99_us"),
+                            field("zombies"), field("leaked_fds"))
+    print line
+}' "$RESULTS" | sort -k1,1 -k5,5nr | awk '
+BEGIN { printf "%-13s %-13s %-8s %-8s %10s %9s %9s %8s %6s\n", "workload", "impl", "correct", "heredoc", "cmds/s", "p50_us", "p99_us", "zombies", "fds" }
+{ if ($1 != last && NR > 1) print ""; last = $1; print }'
+echo
+echo "Raw results appended to $OUTPUT"
@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# Runs the shell benchmarks - process_arglist called directly, then the same workloads through
+# the shell.c loop - and appends the JSON results to bench_output.txt.
+# Usage: bench/run_bench.sh [build-dir] [iterations]
+
+BUILD_DIR="${1:-_gate_build}"
+ITERATIONS="${2:-500}"
+OUTPUT="bench_output.txt"
+
+if [ ! -x "$BUILD_DIR/myshell_bench" ] || [ ! -x "$BUILD_DIR/myshell" ]; then
+    echo "Build first: cmake -S . -B $BUILD_DIR && cmake --build $BUILD_DIR"
+    exit 1
+fi
+
+"$BUILD_DIR/myshell_bench" -n "$ITERATIONS" -o "$OUTPUT" || exit 1
+"$BUILD_DIR/myshell_bench" -s "$BUILD_DIR/myshell" -n "$ITERATIONS" -o "$OUTPUT" || exit 1
+echo "Results appended to $OUTPUT"
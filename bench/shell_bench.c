@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+// Benchmarks a shell implementation's executors.
+//
+// shell_bench [-n iterations] [-i label] [-w workload] [-o file]
+//     links against the implementation and calls process_arglist directly: reports commands/sec
+//     and p50/p99 latency from the call to the command's exit (for background commands, to the
+//     call's return).
+// shell_bench -s shell [-n iterations] [-i label] [-w workload] [-o file]
+//     feeds the same workloads as a script to a built shell through its shell.c loop: reports
+//     commands/sec only.
+//
+// Direct runs also report leaks: children left as zombies and fds left open in the shell
+// process once the workload is over and one more foreground command has run.
+//
+// Every result is one JSON object per line, so runs can be diffed and graphed.
+
+// the implementation's contract, from shell.c
+int process_arglist(int count, char **arglist);
+int prepare(void);
+int finalize(void);
+
+struct workload
+{
+	const char *name;
+	const char *line; // run from a scratch directory holding BENCH_INPUT
+	int background;
+};
+
+struct result
+{
+	const char *workload;
+	const char *mode;
+	int n;
+	double seconds;
+	double p50_us; // < 0 when not measured
+	double p99_us;
+	int zombies; // < 0 when not measured
+	int leaked_fds;
+};
+
+#define BENCH_INPUT "bench_input.txt"
+#define BENCH_OUTPUT "bench_redirect.txt"
+#define MAX_WORDS 16
+#define WARMUP 10
+
+static char scratch_dir[] = "/tmp/shell_bench.XXXXXX";
+
+static const struct workload workloads[] = {
+	{"simple", "true", 0},
+	{"spawn", "sleep 0", 0},
+	{"pipe2", "echo hello | cat", 0},
+	{"redirect_in", "cat < " BENCH_INPUT, 0},
+	{"redirect_out", "echo hello >> " BENCH_OUTPUT, 0},
+	{"background", "sleep 0 &", 1},
+};
+
+int split_line(char *line, char **words);
+double now_us(void);
+int compare_doubles(const void *a, const void *b);
+int count_children(int *zombies);
+int count_open_fds(void);
+void wait_for_children(void);
+int bench_direct(const struct workload *workload, int n, struct result *result);
+int bench_loop(const struct workload *workload, int n, const char *shell, struct result *result);
+void print_result(FILE *out, const char *impl, const struct result *result);
+int make_scratch_dir(void);
+void remove_scratch_dir(void);
+
+// Splits a workload line at spaces into words (NULL terminated). Returns the word count.
+int split_line(char *line, char **words)
+{
+	int count = 0;
+	for (char *word = strtok(line, " "); word != NULL && count < MAX_WORDS; word = strtok(NULL, " "))
+	{
+		words[count++] = word;
+	}
+	words[count] = NULL;
+	return count;
+}
+
+double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Counts our children that have not exited yet from /proc; *zombies (if not NULL) gets the
+// number of exited ones nobody has waited for.
+int count_children(int *zombies)
+{
+	char path[64], stat_path[64], state;
+	int count = 0, pid;
+	FILE *children, *stat;
+
+	if (zombies != NULL)
+	{
+		*zombies = 0;
+	}
+	snprintf(path, sizeof(path), "/proc/self/task/%d/children", (int)getpid());
+	if ((children = fopen(path, "r")) == NULL)
+	{
+		return 0;
+	}
+	while (fscanf(children, "%d", &pid) == 1)
+	{
+		snprintf(stat_path, sizeof(stat_path), "/proc/%d/stat", pid);
+		if ((stat = fopen(stat_path, "r")) == NULL)
+		{
+			continue;
+		}
+		// the state follows the parenthesised command name
+		if (fscanf(stat, "%*d (%*[^)]) %c", &state) == 1)
+		{
+			if (state != 'Z')
+			{
+				count++;
+			}
+			else if (zombies != NULL)
+			{
+				(*zombies)++;
+			}
+		}
+		fclose(stat);
+	}
+	fclose(children);
+	return count;
+}
+
+int count_open_fds(void)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *entry;
+	int count = 0;
+
+	if (dir == NULL)
+	{
+		return 0;
+	}
+	while ((entry = readdir(dir)) != NULL)
+	{
+		count += entry->d_name[0] != '.';
+	}
+	closedir(dir);
+	// opendir's own fd
+	return count - 1;
+}
+
+// Waits until every background child has exited, however the implementation reaps them.
+void wait_for_children(void)
+{
+	struct timespec pause = {0, 200000};
+	while (count_children(NULL) > 0)
+	{
+		nanosleep(&pause, NULL);
+	}
+}
+
+// Runs the workload n times through process_arglist. Returns 0 on success, 1 on failure.
+int bench_direct(const struct workload *workload, int n, struct result *result)
+{
+	char line[256], settle[] = "sleep 0", *words[MAX_WORDS + 1], *arglist[MAX_WORDS + 1];
+	double *latencies = malloc(sizeof(double) * n);
+	double start, begin = 0;
+	int count, fds_before = count_open_fds();
+
+	if (latencies == NULL)
+	{
+		perror("malloc");
+		return 1;
+	}
+	snprintf(line, sizeof(line), "%s", workload->line);
+	count = split_line(line, words);
+
+	for (int i = -WARMUP; i < n; i++)
+	{
+		if (i == 0)
+		{
+			wait_for_children();
+			begin = now_us();
+		}
+		// process_arglist may overwrite arglist entries, so it gets a fresh copy every time
+		memcpy(arglist, words, sizeof(char *) * (count + 1));
+		start = now_us();
+		if (!process_arglist(count, arglist))
+		{
+			fprintf(stderr, "%s: process_arglist asked the shell to stop\n", workload->name);
+			free(latencies);
+			return 1;
+		}
+		if (i >= 0)
+		{
+			latencies[i] = now_us() - start;
+		}
+	}
+	if (workload->background)
+	{
+		wait_for_children();
+	}
+	result->seconds = (now_us() - begin) / 1e6;
+	result->workload = workload->name;
+	result->mode = "direct";
+	result->n = n;
+
+	// Give the implementation one more command to clean up after the workload, then look
+	split_line(settle, arglist);
+	process_arglist(2, arglist);
+	count_children(&result->zombies);
+	result->leaked_fds = count_open_fds() - fds_before;
+
+	qsort(latencies, n, sizeof(double), compare_doubles);
+	result->p50_us = latencies[n / 2];
+	result->p99_us = latencies[(n * 99) / 100];
+	free(latencies);
+	return 0;
+}
+
+// Runs the workload n times as a script fed to the shell binary. Returns 0 on success, 1 on failure.
+int bench_loop(const struct workload *workload, int n, const char *shell, struct result *result)
+{
+	const char *script_path = "bench_script.txt";
+	FILE *script = fopen(script_path, "w");
+	double begin;
+	pid_t pid;
+	int status;
+
+	if (script == NULL)
+	{
+		perror(script_path);
+		return 1;
+	}
+	for (int i = 0; i < n; i++)
+	{
+		fprintf(script, "%s\n", workload->line);
+	}
+	fclose(script);
+
+	begin = now_us();
+	pid = fork();
+	if (pid == -1)
+	{
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0)
+	{
+		int in = open(script_path, O_RDONLY);
+		int null = open("/dev/null", O_WRONLY);
+		if (in == -1 || null == -1 || dup2(in, STDIN_FILENO) == -1 || dup2(null, STDOUT_FILENO) == -1)
+		{
+			perror("redirecting the shell");
+			_exit(127);
+		}
+		execl(shell, shell, (char *)NULL);
+		perror(shell);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 127)
+	{
+		fprintf(stderr, "%s: %s did not run the script\n", workload->name, shell);
+		return 1;
+	}
+	result->workload = workload->name;
+	result->mode = "loop";
+	result->n = n;
+	result->seconds = (now_us() - begin) / 1e6;
+	result->p50_us = -1;
+	result->p99_us = -1;
+	result->zombies = -1;
+	result->leaked_fds = -1;
+	return 0;
+}
+
+void print_result(FILE *out, const char *impl, const struct result *result)
+{
+	fprintf(out, "{\"impl\":\"%s\",\"mode\":\"%s\",\"workload\":\"%s\",\"n\":%d,\"seconds\":%.6f,\"cmds_per_sec\":%.1f",
+			impl, result->mode, result->workload, result->n, result->seconds, result->n / result->seconds);
+	if (result->p50_us >= 0)
+	{
+		fprintf(out, ",\"p50_us\":%.1f,\"p99_us\":%.1f", result->p50_us, result->p99_us);
+	}
+	else
+	{
+		fprintf(out, ",\"p50_us\":null,\"p99_us\":null");
+	}
+	if (result->zombies >= 0)
+	{
+		fprintf(out, ",\"zombies\":%d,\"leaked_fds\":%d}\n", result->zombies, result->leaked_fds);
+	}
+	else
+	{
+		fprintf(out, ",\"zombies\":null,\"leaked_fds\":null}\n");
+	}
+	fflush(out);
+}
+
+// Creates and enters a scratch directory with the input file the workloads read.
+// Returns 0 on success, 1 on failure.
+int make_scratch_dir(void)
+{
+	FILE *input;
+
+	if (mkdtemp(scratch_dir) == NULL || chdir(scratch_dir) == -1)
+	{
+		perror("scratch directory");
+		return 1;
+	}
+	if ((input = fopen(BENCH_INPUT, "w")) == NULL)
+	{
+		perror(BENCH_INPUT);
+		return 1;
+	}
+	for (int i = 0; i < 100; i++)
+	{
+		fprintf(input, "line %d of the benchmark input\n", i);
+	}
+	fclose(input);
+	return 0;
+}
+
+void remove_scratch_dir(void)
+{
+	unlink(BENCH_INPUT);
+	unlink(BENCH_OUTPUT);
+	unlink("bench_script.txt");
+	if (chdir("/") == 0)
+	{
+		rmdir(scratch_dir);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *impl = "myshell", *only = NULL, *shell = NULL, *out_path = NULL;
+	char *shell_path = NULL;
+	int n = 500, opt, null, failed = 0;
+	FILE *out;
+	struct result result;
+
+	while ((opt = getopt(argc, argv, "n:i:w:s:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'i':
+			impl = optarg;
+			break;
+		case 'w':
+			only = optarg;
+			break;
+		case 's':
+			shell = optarg;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-i label] [-w workload] [-s shell] [-o file]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (n < 1)
+	{
+		fprintf(stderr, "iterations must be positive\n");
+		return 2;
+	}
+	// Results go to the real stdout (or -o); the commands' own output goes to /dev/null
+	out = out_path != NULL ? fopen(out_path, "a") : fdopen(dup(STDOUT_FILENO), "w");
+	if (out == NULL)
+	{
+		perror(out_path != NULL ? out_path : "stdout");
+		return 1;
+	}
+	if (shell != NULL && (shell_path = realpath(shell, NULL)) == NULL)
+	{
+		perror(shell);
+		return 1;
+	}
+	if (make_scratch_dir() != 0)
+	{
+		return 1;
+	}
+	if ((null = open("/dev/null", O_WRONLY)) == -1 || dup2(null, STDOUT_FILENO) == -1)
+	{
+		perror("/dev/null");
+		return 1;
+	}
+	close(null);
+
+	// The background workload measures what launching a job costs; myshell's scheduler would
+	// otherwise queue most of them and make it measure the queue
+	setenv("MYSHELL_JOB_SLOTS", "0", 0);
+	// simple and redirect_out measure fork+exec; myshell would otherwise run true and echo in-process
+	setenv("MYSHELL_BUILTINS", "0", 0);
+	if (shell_path == NULL && prepare() != 0)
+	{
+		fprintf(stderr, "prepare failed\n");
+		return 1;
+	}
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+	{
+		if (only != NULL && strcmp(only, workloads[i].name) != 0)
+		{
+			continue;
+		}
+		if (shell_path != NULL ? bench_loop(&workloads[i], n, shell_path, &result)
+							   : bench_direct(&workloads[i], n, &result))
+		{
+			failed = 1;
+			continue;
+		}
+		print_result(out, impl, &result);
+	}
+	if (shell_path == NULL && finalize() != 0)
+	{
+		failed = 1;
+	}
+	remove_scratch_dir();
+	free(shell_path);
+	fclose(out);
+	return failed;
+}
@@ -9,7 +9,7 @@
 int set_signal_handler(int signum, void (*action)(int));
 int exec_command(char **arglist);
 int is_pipe(int count, char **arglist);
-int sin_piping(int pipe_index, char **arglist);
+int sin_piping(int pipe_index, int count, char **arglist);
 int redirecting(int type, int count, char **arglist);
 int exec__background(int count, char **arglist);
 int prepare(void);
@@ -63,70 +63,91 @@ int is_pipe(int count, char **arglist) {
     return count+2;
 }
 
-// run two child process, with the output of the first process as the input of the second one, using single piping
-int sin_piping(int pipe_index, char **arglist) {
+// run a child process per pipeline stage, with the output of each stage as the input of the next one.
+// all the stages are forked before waiting for any of them.
+int sin_piping(int pipe_index, int count, char **arglist) {
     int pipefd[2];
-    pid_t pid1; pid_t pid2;
-    // pipefd is an array of two file descriptors. 
-    // After pipe() - pipefd[0] will refer to the read end, and pipefd[1] will refer to the write end.
-    if (pipe(pipefd) == -1) {
-        perror("failure during pipe");
-        return 0;}
-    pid1 = fork();
-    if (pid1 == -1) { // fork failure
-        perror("failure during forking");
-        return 0;}
-    // first child - write to the pipe his output
-    if (pid1 == 0) {
-        close(pipefd[0]); // close read end of the pipe
-        // foreground child processes should terminate upon SIGINT.
-        // restore default handler for SIGCHLD before execvp
-        if (set_signal_handler(SIGINT, SIG_DFL) + set_signal_handler(SIGCHLD, SIG_DFL) > 0) {
-            exit(1);}
-        // redirect first child output (stdout) to the pipe write end
-        if (dup2(pipefd[1],STDOUT_FILENO) == -1) {
-            perror("failure during redirection (stdout) to the pipe write end");
-            exit(1);}
-        close(pipefd[1]); // close write end of the pipe after redirection
-        // execute first command
-        arglist[pipe_index] = NULL;
-        if (execvp(arglist[0], arglist) == -1) {
-                perror("failure during executing the command");
-                exit(1);}
+    int prev_read = -1; // read end of the previous stage's pipe, -1 for the first stage
+    int stages = 1, started = 0, ret = 1, i, k, end;
+    char **stage = arglist;
+    pid_t *pids;
+    // count the stages, rejecting empty ones ("| cmd", "cmd |", "cmd | | cmd")
+    for (i = pipe_index; i < count; i++) {
+        if (arglist[i][0] != '|') {
+            continue;}
+        if (i == 0 || i == count - 1 || arglist[i - 1][0] == '|') {
+            fprintf(stderr, "empty command in pipeline\n");
+            return 1;}
+        stages++;
     }
-    // parent
-    pid2 = fork();
-    if (pid2 == -1) { // fork failure
-        perror("failure during forking");
+    pids = malloc(sizeof(pid_t) * stages);
+    if (pids == NULL) {
+        perror("failure during malloc");
         return 0;}
-    // second child - read from the pipe his input
-    if (pid2 == 0) {
-        close(pipefd[1]); // close write end of the pipe
-        // foreground child processes should terminate upon SIGINT.
-        // restore default handler for SIGCHLD before execvp
-        if (set_signal_handler(SIGINT, SIG_DFL) + set_signal_handler(SIGCHLD, SIG_DFL) > 0) {
-            exit(1);}
-        // redirect second child input (stdin) to the pipe read end
-        if (dup2(pipefd[0],STDIN_FILENO) == -1) {
-            perror("failure during redirection (stdin) to the pipe read end");
-            exit(1);}
-        close(pipefd[0]); // close read end of the pipe after redirection
-        // execute second command
-        if (execvp(arglist[pipe_index+1], &arglist[pipe_index+1]) == -1) {
+    end = pipe_index;
+    for (k = 0; k < stages; k++) {
+        // split arglist at the end of this stage (the last stage already ends at arglist[count])
+        while (end < count && arglist[end][0] != '|') {
+            end++;}
+        arglist[end] = NULL;
+        // pipefd is an array of two file descriptors.
+        // After pipe() - pipefd[0] will refer to the read end, and pipefd[1] will refer to the write end.
+        // the last stage writes to the shell's stdout, so it needs no pipe.
+        pipefd[0] = -1; pipefd[1] = -1;
+        if (k < stages - 1 && pipe(pipefd) == -1) {
+            perror("failure during pipe");
+            ret = 0;
+            break;}
+        pids[k] = fork();
+        if (pids[k] == -1) { // fork failure
+            perror("failure during forking");
+            ret = 0;
+            break;}
+        // child - read from the previous pipe and write to the next one
+        if (pids[k] == 0) {
+            // foreground child processes should terminate upon SIGINT.
+            // restore default handler for SIGCHLD before execvp
+            if (set_signal_handler(SIGINT, SIG_DFL) + set_signal_handler(SIGCHLD, SIG_DFL) > 0) {
+                exit(1);}
+            // redirect stdin to the previous pipe read end
+            if (prev_read != -1) {
+                if (dup2(prev_read, STDIN_FILENO) == -1) {
+                    perror("failure during redirection (stdin) to the pipe read end");
+                    exit(1);}
+                close(prev_read);}
+            // redirect stdout to the next pipe write end
+            if (pipefd[1] != -1) {
+                close(pipefd[0]); // the next stage reads from it, not us
+                if (dup2(pipefd[1], STDOUT_FILENO) == -1) {
+                    perror("failure during redirection (stdout) to the pipe write end");
+                    exit(1);}
+                close(pipefd[1]);}
+            if (execvp(stage[0], stage) == -1) {
                 perror("failure during executing the command");
                 exit(1);}
+        }
+        // parent - keep only the read end the next stage needs
+        started++;
+        if (prev_read != -1) {
+            close(prev_read);}
+        if (pipefd[1] != -1) {
+            close(pipefd[1]);}
+        prev_read = pipefd[0];
+        stage = &arglist[end + 1];
+        end++;
     }
-    // parent
-    close(pipefd[0]); close(pipefd[1]); // close write and read ends of the pipe 
-    // waiting for both childs to terminate
+    // if a stage failed to start, the already started ones must not block on an open pipe
+    if (prev_read != -1) {
+        close(prev_read);}
+    // waiting for all the stages to terminate
     // ECHILD and EINTR in the parent shell process are not considered as an actual errors according to the instructions
-    if (waitpid(pid1, NULL, 0) == -1 && errno != ECHILD && errno != EINTR) {
-        perror("failure during waitpid");
-        return 0;}
-    if (waitpid(pid2, NULL, 0) == -1 && errno != ECHILD && errno != EINTR) {
-        perror("failure during waitpid");
-        return 0;}
-    return 1;
+    for (k = 0; k < started; k++) {
+        if (waitpid(pids[k], NULL, 0) == -1 && errno != ECHILD && errno != EINTR) {
+            perror("failure during waitpid");
+            ret = 0;}
+    }
+    free(pids);
+    return ret;
 }
 
 // execute the command so the standard output\input is redirected to the output\input file accordingly (depends on type)
@@ -230,7 +251,7 @@ int process_arglist(int count, char **arglist) {
         ret = exec__background(count, arglist);} 
     // piping
     else if (pipe_index != count+2) {
-        ret = sin_piping(pipe_index, arglist);}
+        ret = sin_piping(pipe_index, count, arglist);}
     // input redirection
     else if (count > 1 && arglist[count - 2][0] == '<') {
         ret = redirecting(0, count, arglist);} 
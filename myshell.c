@@ -3,302 +3,5797 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <spawn.h>
 #include <errno.h>
 
+extern char **environ;
+
+// How children are started. Chosen once in prepare() from the MYSHELL_SPAWN environment variable
+// ("posix_spawn" - the default, or "fork").
+enum spawn_backend
+{
+	SPAWN_BACKEND_POSIX, // posix_spawn - glibc clones with CLONE_VM|CLONE_VFORK, no page table copy
+	SPAWN_BACKEND_FORK   // fork + execv, exec failures reported back through a pipe
+};
+
+// Everything a child needs before exec, so both backends can start it the same way.
+struct spawn_request
+{
+	char **argv;
+	int fds[3];        // fds[i] is dup2'd onto fd i in the child, -1 keeps the shell's fd
+	int foreground;    // the shell waits for it (and may hand it the terminal)
+	const char *error; // printed when the command could not be executed
+	pid_t pgroup;      // process group to join, 0 - a new one led by the child
+	int terminal;      // the child takes the terminal for its (new) group
+	const int *inherit; // fds the child keeps open under their own numbers (/dev/fd paths it was given)
+	int inherit_count;
+};
+
+// The process group of the line being started. Every process of a line - all stages of a
+// pipeline, shard copies and fan-out consumers included - joins the group the first one leads,
+// so one killpg reaches all of them.
+struct line_group
+{
+	pid_t pgid; // 0 - no process started yet
+	int foreground;
+	int has_terminal; // the group was given the terminal and the shell has to take it back
+	int relaying;     // the shell is relaying between its stages, so it cannot be suspended
+	struct job *job;  // the job the line runs as - in the background, or once it was suspended
+};
+
+// The controlling terminal, when the shell runs interactively in its foreground. Foreground
+// groups get it while they run, so Ctrl-C and terminal reads go to them and not to the shell.
+struct terminal
+{
+	int fd; // -1 - not interactive
+	pid_t shell_group;
+};
+
+// What a word of the command line is. Operators are recognised once per line by parse_command.
+enum token_kind
+{
+	TOKEN_WORD,
+	TOKEN_PIPE,         // |
+	TOKEN_BACKGROUND,   // &
+	TOKEN_REDIRECT_IN,  // <
+	TOKEN_HEREDOC,      // <<WORD or << WORD - the body shell.c collected after the line
+	TOKEN_HERESTRING,   // <<<word or <<< word - the word and a newline
+	TOKEN_REDIRECT_OUT, // >
+	TOKEN_APPEND,       // >>
+	TOKEN_REDIRECT_ERR, // 2>
+	TOKEN_APPEND_ERR,   // 2>>
+	TOKEN_ERR_TO_OUT,   // 2>&1
+	TOKEN_OUT_TO_ERR,   // >&2 - the last redirection, see is_redirect
+	TOKEN_SHARD,        // |N| - see parse_shard
+	TOKEN_FAN_OUT       // |& - the output goes to every one of a comma-separated list of commands
+};
+
+// A command line with the kind of every word, so the executors never compare strings.
+// One instance is reused for every line; kinds only ever grows.
+struct parsed_command
+{
+	int count;
+	char **argv;
+	unsigned char *kinds; // kinds[i] is the token_kind of argv[i]
+	int kinds_capacity;
+	int background;     // index of the first TOKEN_BACKGROUND, -1 if there is none
+	int redirects;      // number of redirection tokens
+	int pipes;          // number of TOKEN_PIPE and TOKEN_SHARD tokens
+	int shards;         // number of TOKEN_SHARD tokens
+	int fan_outs;       // number of TOKEN_FAN_OUT tokens
+};
+
+// A command's redirections, resolved when it is started. The shell opens the files itself, so one
+// that cannot be opened is reported before anything runs, and the child only dup2s fds onto 0-2.
+struct redirect_plan
+{
+	char **argv;  // the command's words without its redirections, NULL terminated
+	int capacity; // of argv
+	int fds[3];   // fds[i] goes onto fd i in the child (spawn_request.fds), -1 keeps the shell's
+	int owned[3]; // fds[i] was opened for the plan and is closed by redirect_plan_close
+};
+
+// What a redirection operator does to the fd it replaces.
+struct redirection
+{
+	int fd;
+	int flags;    // open flags for its file
+	int from;     // the other standard fd it duplicates, -1 if it opens a file
+	int attached; // length of an operator its operand may be attached to ("<<EOF"), 0 if none
+};
+
+// A here-document body, as shell.c found it in the input after its line.
+struct heredoc
+{
+	const char *text;
+	size_t len;
+};
+
+// The here-document bodies of a command line, in order - each "<<" takes the next one.
+struct heredocs
+{
+	struct heredoc *bodies;
+	int count;
+	int capacity;
+	int next;
+};
+
+// A command line after substitution. The words it points into and the "<(...)" and ">(...)"
+// commands it started live until the line has run.
+struct expansion
+{
+	char **argv; // NULL terminated
+	int count;
+	int capacity;
+	char **buffers; // captured output and /dev/fd paths the words point into
+	int buffer_count;
+	int buffer_capacity;
+	int *fds;   // fds[i] - the line's end of substitution i's pipe, -1 once closed
+	pid_t *pids; // pids[i] - the command of substitution i, 0 once reaped
+	int substitutions;
+	int substitution_capacity;
+};
+
+// A byte queue: data[start..end) is pending, appended at end and consumed from start.
+struct byte_buffer
+{
+	char *data;
+	size_t start;
+	size_t end;
+	size_t capacity;
+};
+
+enum shard_mode
+{
+	SHARD_ROUND_ROBIN, // line i goes to copy i % N
+	SHARD_KEY_HASH     // lines with the same first field go to the same copy
+};
+
+// The shell's side of "producer |N| consumer": it reads the producer's output, deals its lines
+// out to N copies of the consumer, and merges their output back into whole lines. Every copy has
+// its own pair of pipes, so copies never see or split each other's lines.
+struct shard_relay
+{
+	int copies;
+	enum shard_mode mode;
+	int ordered; // merge output lines in input order (each copy must write one line per line read)
+	int next;    // round-robin position
+	int alive;   // copies still accepting input
+	int in;      // producer's output, -1 once at EOF
+	int out;     // where the merged lines go
+	int close_out;
+	int *to_copy;   // to_copy[i] - copy i's stdin, -1 once closed
+	int *from_copy; // from_copy[i] - copy i's stdout, -1 once at EOF
+	struct byte_buffer *pending; // pending[i] - lines not yet written to copy i
+	struct byte_buffer *output;  // output[i] - copy i's output not yet merged
+	struct byte_buffer carry;    // producer output after its last newline
+	struct byte_buffer order;    // ordered only: which copy got each line not merged yet
+	struct byte_buffer merged;   // lines about to be written to out
+	int failed;
+};
+
+// The shell's side of "producer |& a, b, c": every chunk of the producer's output is spliced into
+// a window pipe, tee()d from there to every consumer but the last and spliced to the last one, so
+// the data never enters user space. Only a tee that could not take a whole chunk is completed
+// with an ordinary copy.
+struct fan_out
+{
+	int consumers;
+	int in;           // producer's output
+	int window[2];
+	int *to_consumer; // to_consumer[i] - consumer i's stdin, -1 once it exited
+	char **argv;      // the consumers' words, each command NULL terminated
+	int *first;       // first[i] - index in argv of consumer i's first word
+	char *copy;       // a chunk read out of the window for consumers a tee fell short for
+};
+
+// One resolved command in the PATH cache.
+struct path_entry
+{
+	char *name; // NULL marks an empty slot
+	char *path;
+	unsigned long hits;
+};
+
+// name -> absolute path, filled lazily so PATH is walked once per command name instead of on
+// every exec. Open addressing with linear probing; capacity is always a power of two.
+struct path_cache
+{
+	struct path_entry *slots;
+	size_t capacity;
+	size_t used;
+	char *path_env; // the PATH the entries were resolved against
+};
+
+enum job_state
+{
+	JOB_QUEUED, // waiting for a process to become available
+	JOB_RUNNING,
+	JOB_STOPPED, // suspended (Ctrl-Z) until fg or bg continues it
+	JOB_DONE
+};
+
+// One process of a job: a background command has one, a suspended foreground pipeline one per stage.
+struct job_process
+{
+	pid_t pid;
+	int pidfd; // becomes readable when the process exits, -1 if it could not be opened
+	struct job *job;
+	struct job_process *next;
+};
+
+// A command started in the background with '&', or a foreground line suspended with Ctrl-Z.
+struct job
+{
+	int id;
+	pid_t pgid;
+	struct job_process *processes; // not yet reaped
+	pid_t last_pid;                // the last stage, whose status is the job's
+	enum job_state state;
+	int status; // wait status and resource usage (summed over its processes), valid once done
+	struct rusage usage;
+	struct timespec started;
+	char *command;
+	char **argv;              // a copy of the command line while queued, NULL once started
+	int priority;             // queued jobs with a higher priority start first
+	struct job *next_queued;
+	struct timeout *timeout;  // the deadline of the line that queued it, while queued
+	struct heredocs heredocs; // copies of its line's here-documents, while queued
+};
+
+// Background jobs, found by id or by pid in O(1). Exited jobs are reported through an epoll set
+// of their pidfds, so reaping never scans the table.
+struct job_table
+{
+	struct job **by_id; // by_id[id - 1], NULL for an unused id
+	int id_capacity;
+	int highest_id;      // new jobs get the id after the highest one in use, like bash
+	struct job_process **by_pid; // open addressing, linear probing, power of two capacity
+	size_t pid_capacity;
+	size_t pid_used;
+	int running;   // started and not done, stopped ones included
+	int stopped;
+	int unwatched; // processes without a pidfd, which reap_jobs polls for
+	pid_t *untracked; // unwatched processes not in by_pid either, each reaped with wait4(pid)
+	int untracked_count;
+	int untracked_capacity;
+	int epoll_fd;
+	struct job *queue_head; // queued jobs by priority, in the order they were submitted within one
+	struct job *queue_tail;
+	int queued;
+	int slots;            // background jobs allowed to run at once, 0 - no limit
+	int queue_priority;   // priority of newly queued jobs
+	int queue_stalls; // times in a row the queue could not start with none of our children left
+};
+
+// How often starting a child failed because the system was out of processes or memory, and what
+// the shell did about it. Reported by the spawnstat builtin.
+struct spawn_pressure
+{
+	unsigned long spawns;
+	unsigned long exhausted; // spawns that failed with EAGAIN or ENOMEM
+	unsigned long retries;
+	unsigned long backoff_ms;
+	unsigned long refused; // commands given up on after SPAWN_RETRIES retries
+	unsigned long queued;  // background commands that had to wait in the queue
+	int peak_queued;
+};
+
+// How pipeline pipes are sized: the kernel's default, a fixed capacity, or adaptive - start at the
+// default and double a pipe whenever the stage writing it is found waiting on it.
+struct pipe_sizing
+{
+	int size; // bytes, 0 - the kernel's default
+	int adaptive;
+};
+
+// Settings for the current line only, from prefixes before its command ("pipesize 1M a | b").
+struct line_options
+{
+	int has_pipe_sizing;
+	struct pipe_sizing pipe_sizing;
+	int time; // print the line's command_record when it is done
+	double timeout; // seconds the line's processes may run, 0 - no limit
+};
+
+#define RECORD_COMMAND_MAX 128
+
+// What one command line cost: a single process, a whole pipeline or a background job.
+struct command_record
+{
+	char command[RECORD_COMMAND_MAX]; // the command line, cut short if longer
+	struct timespec started;
+	double real;         // seconds from before the first spawn to the last reap
+	struct rusage usage; // summed over its processes, except ru_maxrss - the largest of them
+	int status;          // wait status of the last process reaped
+	int processes;
+};
+
+#define STATS_NAME_MAX 36
+
+// The stats log (MYSHELL_STATS_LOG) is a header followed by one fixed-size stats_entry per process,
+// appended by every shell that has it open. Shells share it through a MAP_SHARED mapping: a slot is
+// claimed by atomically bumping records, so concurrent appends never collide.
+struct stats_header
+{
+	char magic[8];
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint64_t records; // slots claimed so far
+};
+
+struct stats_entry
+{
+	uint64_t finished_ns; // CLOCK_REALTIME
+	uint64_t duration_ns;
+	int64_t max_rss_kb;
+	int32_t status;
+	char name[STATS_NAME_MAX]; // argv[0] without its directory; empty until the slot is written
+};
+
+// A child that gets a stats_entry when it is reaped: when it was started and as what.
+struct stats_pending
+{
+	pid_t pid;
+	struct timespec started;
+	char name[STATS_NAME_MAX];
+};
+
+struct stats_log
+{
+	int fd;
+	struct stats_header *map;
+	size_t mapped;                 // bytes of the file that are mapped
+	struct stats_pending *pending; // children started and not yet reaped
+	int pending_count;
+	int pending_capacity;
+};
+
+// Everything the shell waits for besides its input - exited background jobs (the job table's
+// epoll fd), SIGCHLD and SIGINT (a signalfd; both are blocked) and foreground children being
+// waited for - in one epoll set, which shell.c polls together with stdin.
+struct event_loop
+{
+	int epoll_fd;
+	int signal_fd;
+	unsigned long interrupts; // SIGINTs received - the shell itself never stops for one
+};
+
+// A deadline on one command line (the timeout prefix), enforced through a timerfd in the event
+// loop. When it expires, every process the line started that is still running gets SIGTERM, and
+// SIGKILL TIMEOUT_KILL_DELAY_MS later. It lives as long as the line runs, its processes are not
+// reaped or its queued background jobs have not started.
+struct timeout
+{
+	int fd;
+	int signal; // the last signal sent, 0 before the deadline
+	double seconds;
+	char command[RECORD_COMMAND_MAX];
+	pid_t *pids;  // started and not yet reaped
+	pid_t *pgids; // the process group of each
+	int count;
+	int capacity;
+	int users; // pids, queued jobs and the line itself
+	struct timeout *next;
+};
+
+// The trace (MYSHELL_TRACE) is a Chrome trace-event JSON array: the shell's own work (parsing,
+// pipes, waiting) on its track and every child's spawn and lifetime on a track of its own.
+struct trace
+{
+	FILE *out;
+	pid_t shell;
+	int events;
+};
+
+// One command name's entries from the stats log, with durations in an HDR-style histogram: exact
+// below 2^(HIST_SUB_BITS+1) us, then 2^HIST_SUB_BITS buckets per power of two, so any percentile is
+// within 1/2^HIST_SUB_BITS of the truth whatever the range.
+struct command_stats
+{
+	char name[STATS_NAME_MAX];
+	uint64_t count;
+	uint64_t failures;
+	uint64_t total_us;
+	uint64_t max_us;
+	int64_t max_rss_kb;
+	uint32_t *histogram;
+};
+
+// The last capacity command records, kept in a ring; the oldest is overwritten first.
+struct command_history
+{
+	struct command_record *records;
+	int capacity;
+	int count;
+	int next; // where the next record goes
+};
+
+// A word that applies to the rest of its line. With nothing after its arguments it is an
+// ordinary builtin of the same name instead.
+struct prefix
+{
+	const char *name;
+	int args;                  // words it takes after its name
+	int (*apply)(char **args); // returns 0, or 1 after reporting a bad argument
+};
+
+// A command run inside the shell process instead of by a child.
+struct builtin
+{
+	const char *name;
+	int (*run)(int count, char **arglist); // same contract as process_arglist
+	int has_binary; // an external program of the same name exists; MYSHELL_BUILTINS=0 uses it instead
+};
+
+#define COMMAND_HISTORY_DEFAULT 256
+#define SLOWEST_DEFAULT 10
+
+#define STATS_MAGIC "MSHSTAT1"
+#define STATS_GROW (1024 * 1024)
+#define HIST_SUB_BITS 5
+#define HIST_MAX_MSB 40 // durations are capped at 2^41 us - about 25 days
+#define HIST_BUCKETS ((HIST_MAX_MSB - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+
+#define JOB_TABLE_INITIAL_CAPACITY 64
+#define REAP_BATCH 64
+#define EVENT_BATCH 16
+#define TIMEOUT_KILL_DELAY_MS 2000
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define POSIX_SPAWN_TCSETPGROUP_AVAILABLE // posix_spawn can hand the child the terminal
+#endif
+#define UNWATCHED_POLL_MS 10
+
+// A fork that fails with EAGAIN or ENOMEM is retried after 1, 2, 4, ... ms, at most this many times
+#define SPAWN_RETRIES 8
+#define SPAWN_BACKOFF_INITIAL_MS 1
+#define SPAWN_BACKOFF_MAX_MS 128
+
+#define FAN_OUT_CHUNK (1024 * 1024)
+
+#define PIPE_MAX_SIZE_PATH "/proc/sys/fs/pipe-max-size"
+#define PIPE_ADAPT_INTERVAL_MS 5
+
+#define SHARD_MAX_COPIES 255
+#define SHARD_READ_SIZE 65536
+#define SHARD_HIGH_WATER (256 * 1024) // input queued for one copy at which the producer is paused
+
+#define PATH_CACHE_INITIAL_CAPACITY 64
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+static enum spawn_backend spawn_backend = SPAWN_BACKEND_POSIX;
+static struct path_cache path_cache;
+static struct parsed_command parsed_command;
+static struct redirect_plan redirect_plan;     // the stage being started by the current line
+static struct redirect_plan queued_job_plan;   // the queued job being started
+static struct heredocs line_heredocs;          // the running line's, pointing into shell.c's input
+static struct expansion *line_expansion;       // the running line's substitutions, NULL if it has none
+static struct job_table jobs = {.epoll_fd = -1};
+static struct spawn_pressure spawn_pressure;
+static struct pipe_sizing pipe_sizing;
+static struct line_options line_options;
+static int pipe_max_size;             // read from PIPE_MAX_SIZE_PATH on first use
+static unsigned long pipes_grown;     // by adaptive sizing
+static struct command_record line_record; // filled by wait_child while a line runs
+static struct command_history command_history = {.capacity = COMMAND_HISTORY_DEFAULT};
+static struct stats_log stats_log = {.fd = -1};
+static struct trace trace;
+static struct event_loop events = {.epoll_fd = -1, .signal_fd = -1};
+static struct timeout *timeouts;      // every live deadline
+static struct timeout *spawn_timeout; // the deadline new processes fall under, if any
+static struct line_group line_group;
+static struct terminal terminal = {.fd = -1};
+
+// Operator kind by first character; the rest of the word is checked by classify_token.
+static const unsigned char operator_table[256] = {
+	['|'] = TOKEN_PIPE,
+	['&'] = TOKEN_BACKGROUND,
+	['<'] = TOKEN_REDIRECT_IN,
+	['>'] = TOKEN_REDIRECT_OUT,
+};
+
+static const struct redirection redirections[] = {
+	[TOKEN_REDIRECT_IN] = {STDIN_FILENO, O_RDONLY, -1},
+	[TOKEN_HEREDOC] = {STDIN_FILENO, 0, -1, 2},
+	[TOKEN_HERESTRING] = {STDIN_FILENO, 0, -1, 3},
+	[TOKEN_REDIRECT_OUT] = {STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC, -1},
+	[TOKEN_APPEND] = {STDOUT_FILENO, O_WRONLY | O_CREAT | O_APPEND, -1},
+	[TOKEN_REDIRECT_ERR] = {STDERR_FILENO, O_WRONLY | O_CREAT | O_TRUNC, -1},
+	[TOKEN_APPEND_ERR] = {STDERR_FILENO, O_WRONLY | O_CREAT | O_APPEND, -1},
+	[TOKEN_ERR_TO_OUT] = {STDERR_FILENO, 0, STDOUT_FILENO},
+	[TOKEN_OUT_TO_ERR] = {STDOUT_FILENO, 0, STDERR_FILENO},
+};
+
 int process_arglist(int count, char **arglist);
-int run_process_background(int count, char **arglist);
-int pipe_it_up(int count, char **arglist, int i);
-int open_child_process_input(int count, char **arglist);
-int open_child_process_output(int count, char **arglist);
-int execute_general(int count, char **arglist);
+int run_command_line(int count, char **arglist);
+int is_substitution(const char *word);
+int expand_words(struct expansion *exp, int count, char **words);
+int expansion_append(struct expansion *exp, char *word);
+int expansion_keep(struct expansion *exp, char *buffer);
+int expand_output(struct expansion *exp, int count, char **words);
+char *capture_output(int count, char **words, size_t *len);
+int start_substitution(struct expansion *exp, int input, int count, char **words);
+void expansion_finish(struct expansion *exp);
+void expansion_free(struct expansion *exp);
+int apply_prefixes(int count, char **arglist);
+int dispatch_command(struct parsed_command *cmd);
+int wait_child(pid_t pid);
+void record_start(struct command_record *record, int count, char **argv);
+void record_process(struct command_record *record, int status, const struct rusage *usage);
+void record_finish(struct command_record *record);
+void print_record_row(const struct command_record *record);
+int prefix_time(char **args);
+int stats_log_open(const char *path);
+int stats_log_map(size_t size);
+void stats_log_spawned(pid_t pid, const char *command);
+void stats_log_reaped(pid_t pid, int status, const struct rusage *usage);
+void stats_log_append(const struct stats_pending *process, int status, const struct rusage *usage);
+void stats_log_close(void);
+int trace_open(const char *path);
+uint64_t trace_clock(void);
+void trace_event(const char *phase, const char *name, const char *category, pid_t track, uint64_t ts);
+void trace_string(const char *s);
+void trace_span(const char *name, const char *category, pid_t track, uint64_t start, const char *detail);
+void trace_process_start(pid_t pid, char **argv);
+void trace_process_end(pid_t pid, int status);
+void trace_close(void);
+int open_pipe(int pipefd[2]);
+int histogram_index(uint64_t us);
+uint64_t histogram_value(int index);
+uint64_t histogram_percentile(const struct command_stats *stats, double percentile);
+struct command_stats *stats_slot(struct command_stats *table, size_t capacity, const char *name);
+int compare_total_time(const void *a, const void *b);
+int builtin_stats(int count, char **arglist);
+int builtin_rusage(int count, char **arglist);
+int parse_command(struct parsed_command *cmd, int count, char **arglist);
+enum token_kind classify_token(const char *word);
+int run_process_background(struct parsed_command *cmd, int op);
+int run_pipeline_background(struct parsed_command *cmd, int op);
+int pipe_it_up(struct parsed_command *cmd);
+int is_stage_separator(enum token_kind kind);
+int parse_shard(const char *word, struct shard_relay *relay);
+int shard_relay_alloc(struct shard_relay *relay);
+void shard_relay_close(struct shard_relay *relay);
+int start_shard_copies(struct shard_relay *relay, char **argv, pid_t *pids);
+void shard_relay_run(struct shard_relay *relay);
+void shard_read_input(struct shard_relay *relay);
+void shard_distribute(struct shard_relay *relay, const char *lines, size_t len);
+void shard_write_copy(struct shard_relay *relay, int copy);
+void shard_read_output(struct shard_relay *relay, int copy);
+void shard_merge(struct shard_relay *relay, int final);
+void shard_flush(struct shard_relay *relay);
+int parse_fan_out(struct parsed_command *cmd, int op, struct fan_out *fan);
+int start_fan_out_consumers(struct fan_out *fan, pid_t *pids);
+void fan_out_run(struct fan_out *fan);
+int fan_out_copy(struct fan_out *fan, size_t len);
+void fan_out_drop(struct fan_out *fan, int consumer);
+void fan_out_close(struct fan_out *fan);
+int parse_pipe_sizing(const char *word, struct pipe_sizing *sizing);
+const struct pipe_sizing *current_pipe_sizing(void);
+int get_pipe_max_size(void);
+void size_pipe(int fd);
+int watch_pipeline(pid_t *pids, int count);
+void grow_full_pipe(pid_t writer);
+int prefix_pipesize(char **args);
+int builtin_pipesize(int count, char **arglist);
+int buffer_reserve(struct byte_buffer *buffer, size_t room);
+int buffer_append(struct byte_buffer *buffer, const char *data, size_t len);
+int is_redirect(enum token_kind kind);
+int redirect_plan_build(struct redirect_plan *plan, char **words, const unsigned char *kinds, const int base[3],
+						struct heredocs *heredocs);
+void redirect_plan_set(struct redirect_plan *plan, int fd, int target, int owned);
+void redirect_plan_close(struct redirect_plan *plan);
+void add_heredoc(int index, const char *body, size_t len);
+int heredocs_copy(struct heredocs *to, const struct heredocs *from);
+int open_here_text(const char *text, size_t len, int newline);
+int execute_general(struct parsed_command *cmd);
+void init_spawn_request(struct spawn_request *req, char **argv, int foreground, const char *error);
+pid_t spawn_process(const struct spawn_request *req);
+pid_t spawn_admitted(const struct spawn_request *req);
+int spawn_is_exhausted(int err);
+void spawn_backoff(int delay_ms);
+int builtin_spawnstat(int count, char **arglist);
+pid_t spawn_posix(const struct spawn_request *req, const char *path);
+pid_t spawn_fork(const struct spawn_request *req, const char *path);
+const char *resolve_command(const char *name);
+char *search_path(const char *name, const char *path_env);
+struct path_entry *path_cache_slot(const char *name);
+void path_cache_forget(const char *name);
+void path_cache_clear(void);
+int path_cache_grow(void);
+int builtin_hash(int count, char **arglist);
+struct job *job_add(pid_t pid, char **argv);
+void job_untracked(pid_t pid);
+int job_add_process(struct job *job, pid_t pid);
+struct job *job_suspend_line(void);
+int job_is_stopped(const struct job *job);
+void job_continue(struct job *job);
+struct job *job_argument(int count, char **arglist, const char *builtin);
+void add_usage(struct rusage *total, const struct rusage *usage);
+int builtin_fg(int count, char **arglist);
+int builtin_bg(int count, char **arglist);
+int builtin_kill(int count, char **arglist);
+int parse_signal(const char *word);
+struct job *job_create(char **argv);
+void job_start(struct job *job, pid_t pid);
+struct job *job_queue(char **argv);
+void start_queued_jobs(void);
+void job_enqueue(struct job *job);
+struct job *job_dequeue(void);
+void job_unqueue(struct job *job);
+void job_drop_queued(struct job *job, int status);
+int job_slots_full(void);
+int builtin_sched(int count, char **arglist);
+int job_table_grow(void);
+struct job_process **job_pid_slot(pid_t pid);
+void job_pid_remove(pid_t pid);
+struct job *job_by_id(int id);
+void job_reaped(struct job_process *process, int status, const struct rusage *usage);
+void job_remove(struct job *job);
+void reap_jobs(int timeout_ms);
+int events_open(void);
+int run_events(int fd, int timeout_ms);
+int event_fd(void);
+int handle_events(void);
+void events_close(void);
+int events_wanted(void);
+int await_fd(int fd, short what);
+int prefix_timeout(char **args);
+struct timeout *timeout_start(double seconds, const char *command);
+void timeout_track(struct timeout *timeout, pid_t pid);
+void timeout_untrack(pid_t pid);
+void timeout_release(struct timeout *timeout);
+void timeout_expire(struct timeout *timeout);
+void terminal_open(void);
+void line_group_end(void);
+void print_job(const struct job *job);
+int parse_job_id(const char *word);
+int builtin_jobs(int count, char **arglist);
+int builtin_wait(int count, char **arglist);
+const struct builtin *find_builtin(const char *name);
+int run_builtin(const struct builtin *builtin, char **argv, const int fds[3]);
+int write_all(int fd, const char *buf, size_t len);
+int builtin_echo(int count, char **arglist);
+int builtin_true(int count, char **arglist);
+int builtin_false(int count, char **arglist);
+int builtin_cd(int count, char **arglist);
+int builtin_pwd(int count, char **arglist);
+int builtin_exit(int count, char **arglist);
 void raise_error(const char *error_type);
+void report_child_error(int status_fd);
 int prepare(void);
 int handle_signal(int signum, void (*action)(int));
 int finalize(void);
 
+static const struct builtin builtins[] = {
+	{"echo", builtin_echo, 1},
+	{"true", builtin_true, 1},
+	{"false", builtin_false, 1},
+	{"pwd", builtin_pwd, 1},
+	{"cd", builtin_cd, 0},
+	{"exit", builtin_exit, 0},
+	{"hash", builtin_hash, 0},
+	{"jobs", builtin_jobs, 0},
+	{"wait", builtin_wait, 0},
+	{"spawnstat", builtin_spawnstat, 0},
+	{"sched", builtin_sched, 0},
+	{"pipesize", builtin_pipesize, 0},
+	{"rusage", builtin_rusage, 0},
+	{"stats", builtin_stats, 0},
+	{"fg", builtin_fg, 0},
+	{"bg", builtin_bg, 0},
+	{"kill", builtin_kill, 0},
+};
+
+static const struct prefix prefixes[] = {
+	{"pipesize", 1, prefix_pipesize},
+	{"time", 0, prefix_time},
+	{"timeout", 1, prefix_timeout},
+};
+static int builtins_in_process = 1;
+
 // arglist - a list of char* arguments (words) provided by the user
 // it contains count+1 items, where the last item (arglist[count]) and *only* the last is NULL
 // RETURNS - 1 if should continue, 0 otherwise.
 int process_arglist(int count, char **arglist)
 {
-	if (count == 1)
+	struct expansion expansion = {0};
+	struct expansion *outer = line_expansion; // a "$(...)" runs its line inside another one
+	int substitutions = 0, ret = 1;
+
+	// Only lines with a "$(", "<(" or ">(" word pay for substitution
+	for (int i = 0; i < count && !substitutions; i++)
+	{
+		substitutions = is_substitution(arglist[i]);
+	}
+	if (!substitutions)
+	{
+		line_expansion = NULL;
+		ret = run_command_line(count, arglist);
+		line_expansion = outer;
+		return ret;
+	}
+	line_expansion = &expansion;
+	if (expand_words(&expansion, count, arglist) == 0 && expansion.count > 0)
+	{
+		ret = run_command_line(expansion.count, expansion.argv);
+	}
+	// Also when the line stopped short of running them, its substitutions are finished and reaped
+	expansion_finish(&expansion);
+	line_group_end();
+	line_heredocs.count = 0;
+	expansion_free(&expansion);
+	line_expansion = outer;
+	return ret;
+}
+
+// Runs a command line whose substitutions (if any) are done. Returns what process_arglist does.
+int run_command_line(int count, char **arglist)
+{
+	struct parsed_command *cmd = &parsed_command;
+	int prefix_words, ret;
+	uint64_t started = trace_clock();
+
+	line_options = (struct line_options){0};
+	if ((prefix_words = apply_prefixes(count, arglist)) < 0)
+	{
+		line_heredocs.count = 0;
+		return 1;
+	}
+	count -= prefix_words;
+	arglist += prefix_words;
+	if (parse_command(cmd, count, arglist) != 0)
+	{
+		perror("Error - Could not parse command");
+		line_heredocs.count = 0;
+		return 0;
+	}
+	trace_span("parse", "shell", trace.shell, started, NULL);
+	// Collect background jobs that exited since the last command
+	reap_jobs(0);
+	record_start(&line_record, count, arglist);
+	if (line_options.timeout > 0)
+	{
+		spawn_timeout = timeout_start(line_options.timeout, line_record.command);
+	}
+	ret = dispatch_command(cmd);
+	if (spawn_timeout != NULL)
+	{
+		// Background jobs it started (or queued) keep it until they finish
+		timeout_release(spawn_timeout);
+		spawn_timeout = NULL;
+	}
+	if (line_expansion != NULL)
+	{
+		expansion_finish(line_expansion);
+	}
+	line_group_end();
+	// The bodies point into input shell.c is about to reuse
+	line_heredocs.count = 0;
+	record_finish(&line_record);
+	if (trace.out != NULL)
+	{
+		trace_span("line", "shell", trace.shell, started, line_record.command);
+		// A trace is readable while the shell still runs
+		fflush(trace.out);
+	}
+	if (line_options.time)
+	{
+		fprintf(stderr, "real\t%.3fs\nuser\t%ld.%03lds\nsys\t%ld.%03lds\nmaxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+				line_record.real, (long)line_record.usage.ru_utime.tv_sec, (long)line_record.usage.ru_utime.tv_usec / 1000,
+				(long)line_record.usage.ru_stime.tv_sec, (long)line_record.usage.ru_stime.tv_usec / 1000,
+				line_record.usage.ru_maxrss, line_record.usage.ru_nvcsw, line_record.usage.ru_nivcsw);
+	}
+	return ret;
+}
+
+// Runs a parsed command line with the executor its operators call for. Redirections are not
+// operators of the line - every command applies its own.
+int dispatch_command(struct parsed_command *cmd)
+{
+	if (cmd->background == 0)
+	{
+		// "&", "& cmd" - nothing to start
+		fprintf(stderr, "Error - empty command before &\n");
+		return 1;
+	}
+	if (line_expansion != NULL && line_expansion->substitutions > 0 && cmd->background != -1)
+	{
+		// The line's end of the pipes is closed, and their commands reaped, when the line ends
+		fprintf(stderr, "Error - <(...) and >(...) cannot be used in the background\n");
+		return 1;
+	}
+	if (cmd->pipes > 0 && cmd->background != -1)
+	{
+		// run every stage in the background, as one job
+		return run_pipeline_background(cmd, cmd->background);
+	}
+	if (cmd->pipes > 0)
+	{
+		// run a child process per pipeline stage, each one's output piped to the input of the next.
+		return pipe_it_up(cmd);
+	}
+	if (cmd->background != -1)
+	{
+		// run the child process in the background
+		return run_process_background(cmd, cmd->background);
+	}
+	// run the command (in the shell if it is a builtin) and wait for it
+	return execute_general(cmd);
+}
+
+// Whether word opens a substitution - "$(", "<(" or ">(".
+int is_substitution(const char *word)
+{
+	return (word[0] == '$' || word[0] == '<' || word[0] == '>') && word[1] == '(';
+}
+
+// Appends words to exp->argv with every substitution among them replaced: "$(cmd ...)" by the
+// words of cmd's output, "<(cmd ...)" and ">(cmd ...)" by the /dev/fd path of a pipe from or to
+// cmd, which runs alongside the line. A substitution takes the words up to the one whose ')'
+// closes it. Returns 0 on success, 1 (after reporting) on failure.
+int expand_words(struct expansion *exp, int count, char **words)
+{
+	for (int i = 0; i < count; i++)
+	{
+		char **inner;
+		size_t last;
+		int end, depth = 0, n = 0, failed;
+
+		if (!is_substitution(words[i]))
+		{
+			if (expansion_append(exp, words[i]) != 0)
+			{
+				return 1;
+			}
+			continue;
+		}
+		for (end = i; end < count; end++)
+		{
+			for (const char *c = words[end]; *c != '\0'; c++)
+			{
+				depth += (*c == '(') - (*c == ')');
+			}
+			if (depth <= 0)
+			{
+				break;
+			}
+		}
+		if (end == count || depth < 0 || words[end][(last = strlen(words[end])) - 1] != ')')
+		{
+			fprintf(stderr, "Error - a substitution has to end with the ')' of its last word\n");
+			return 1;
+		}
+		words[end][last - 1] = '\0';
+		// The command's words - the rest of the opening word, up to the one with the ')'
+		inner = malloc(sizeof(char *) * (end - i + 2));
+		if (inner == NULL)
+		{
+			perror("Error - Could not expand command");
+			return 1;
+		}
+		for (int j = i; j <= end; j++)
+		{
+			char *word = j == i ? words[j] + 2 : words[j];
+			if (word[0] != '\0')
+			{
+				inner[n++] = word;
+			}
+		}
+		inner[n] = NULL;
+		if (n == 0)
+		{
+			fprintf(stderr, "Error - empty substitution\n");
+			failed = 1;
+		}
+		else if (words[i][0] == '$')
+		{
+			failed = expand_output(exp, n, inner);
+		}
+		else
+		{
+			failed = start_substitution(exp, words[i][0] == '<', n, inner);
+		}
+		free(inner);
+		if (failed)
+		{
+			return 1;
+		}
+		i = end;
+	}
+	return 0;
+}
+
+// Appends word to exp->argv, keeping it NULL terminated. Returns 0 on success, 1 (after reporting)
+// if it could not grow.
+int expansion_append(struct expansion *exp, char *word)
+{
+	if (exp->count + 2 > exp->capacity)
+	{
+		int capacity = exp->capacity == 0 ? 16 : exp->capacity * 2;
+		char **argv = realloc(exp->argv, sizeof(char *) * capacity);
+		if (argv == NULL)
+		{
+			perror("Error - Could not expand command");
+			return 1;
+		}
+		exp->argv = argv;
+		exp->capacity = capacity;
+	}
+	exp->argv[exp->count++] = word;
+	exp->argv[exp->count] = NULL;
+	return 0;
+}
+
+// Makes exp own buffer (freed with it). Returns 0 on success, 1 (after reporting, with buffer
+// freed) if it could not be recorded.
+int expansion_keep(struct expansion *exp, char *buffer)
+{
+	if (exp->buffer_count == exp->buffer_capacity)
+	{
+		int capacity = exp->buffer_capacity == 0 ? 4 : exp->buffer_capacity * 2;
+		char **buffers = realloc(exp->buffers, sizeof(char *) * capacity);
+		if (buffers == NULL)
+		{
+			perror("Error - Could not expand command");
+			free(buffer);
+			return 1;
+		}
+		exp->buffers = buffers;
+		exp->buffer_capacity = capacity;
+	}
+	exp->buffers[exp->buffer_count++] = buffer;
+	return 0;
+}
+
+// "$(words)" - runs words as a command line and appends the words of its output to exp->argv,
+// split at spaces, tabs and newlines like shell.c splits lines. Returns 0 on success, 1 (after
+// reporting) on failure.
+int expand_output(struct expansion *exp, int count, char **words)
+{
+	size_t len;
+	char *output = capture_output(count, words, &len);
+	int in_word = 0;
+
+	if (output == NULL)
+	{
+		perror("Error - Could not capture command output");
+		return 1;
+	}
+	if (expansion_keep(exp, output) != 0)
+	{
+		return 1;
+	}
+	for (size_t i = 0; i < len; i++)
+	{
+		if (output[i] == ' ' || output[i] == '\t' || output[i] == '\n')
+		{
+			output[i] = '\0';
+			in_word = 0;
+		}
+		else if (!in_word)
+		{
+			if (expansion_append(exp, &output[i]) != 0)
+			{
+				return 1;
+			}
+			in_word = 1;
+		}
+	}
+	return 0;
+}
+
+// Runs words as a command line of its own, inside the current one, with the shell's stdout
+// pointed at a memfd. The command writes straight into it, so nothing has to be relayed while it
+// runs, and once it is done one read of the memfd's exact size takes the output in.
+// Returns the output (NUL terminated, its length in *len, to be freed), or NULL with errno set.
+char *capture_output(int count, char **words, size_t *len)
+{
+	struct line_group group = line_group;
+	struct heredocs heredocs = line_heredocs;
+	int memfd = memfd_create("substitution", MFD_CLOEXEC), saved, err;
+	char *output = NULL;
+	struct stat st;
+	ssize_t n;
+
+	if (memfd == -1)
+	{
+		return NULL;
+	}
+	fflush(stdout);
+	saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+	if (saved == -1 || dup2(memfd, STDOUT_FILENO) == -1)
+	{
+		err = errno;
+		if (saved != -1)
+		{
+			close(saved);
+		}
+		close(memfd);
+		errno = err;
+		return NULL;
+	}
+	// Its processes are a group of their own, and the here-documents are the enclosing line's
+	line_group = (struct line_group){0};
+	line_heredocs.count = 0;
+	process_arglist(count, words);
+	line_group = group;
+	line_heredocs = heredocs;
+	if (line_group.has_terminal)
+	{
+		// The line's "<(...)" commands started before it had the terminal
+		tcsetpgrp(terminal.fd, line_group.pgid);
+	}
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	if (fstat(memfd, &st) == 0 && (output = malloc(st.st_size + 1)) != NULL)
+	{
+		for (*len = 0; *len < (size_t)st.st_size; *len += n)
+		{
+			if ((n = pread(memfd, output + *len, st.st_size - *len, *len)) <= 0)
+			{
+				break;
+			}
+		}
+		output[*len] = '\0';
+	}
+	err = errno;
+	close(memfd);
+	errno = err;
+	return output;
+}
+
+// "<(words)" (input - the line reads the command's output) or ">(words)" - starts words with a
+// pipe as its stdout or stdin and appends the /dev/fd path of the pipe's other end to exp->argv.
+// The line's commands get that end under its own number; it is closed, and the command reaped,
+// when the line ends. Returns 0 on success, 1 (after reporting) on failure.
+int start_substitution(struct expansion *exp, int input, int count, char **words)
+{
+	static const int keep[3] = {-1, -1, -1};
+	struct heredocs none = {0};
+	struct spawn_request req;
+	int first = exp->count, pipefd[2], line_end, command_end, *fds;
+	char *path;
+	pid_t pid, *pids;
+
+	// The command's words are expanded onto the end of exp->argv, run from there and taken off
+	if (expand_words(exp, count, words) != 0)
+	{
+		return 1;
+	}
+	for (int i = first; i < exp->count; i++)
+	{
+		enum token_kind kind = classify_token(exp->argv[i]);
+		if (is_stage_separator(kind) || kind == TOKEN_BACKGROUND)
+		{
+			fprintf(stderr, "Error - <(...) and >(...) take a single command\n");
+			return 1;
+		}
+	}
+	if (redirect_plan_build(&redirect_plan, &exp->argv[first], NULL, keep, &none) != 0)
+	{
+		return 1;
+	}
+	if (open_pipe(pipefd) == -1)
+	{
+		perror("Error - could not create pipe");
+		redirect_plan_close(&redirect_plan);
+		return 1;
+	}
+	line_end = input ? pipefd[0] : pipefd[1];
+	command_end = input ? pipefd[1] : pipefd[0];
+	init_spawn_request(&req, redirect_plan.argv, 1, "Error - Could not execute child process");
+	memcpy(req.fds, redirect_plan.fds, sizeof(req.fds));
+	// Its own redirections win over the pipe
+	if (req.fds[input ? STDOUT_FILENO : STDIN_FILENO] == -1)
+	{
+		req.fds[input ? STDOUT_FILENO : STDIN_FILENO] = command_end;
+	}
+	// It must not hold the line's end of another substitution's pipe
+	req.inherit_count = 0;
+	pid = spawn_admitted(&req);
+	redirect_plan_close(&redirect_plan);
+	close(command_end);
+	exp->count = first;
+	exp->argv[first] = NULL;
+	if (pid == -1)
+	{
+		perror("Failed during forking");
+		close(line_end);
+		return 1;
+	}
+
+	if (exp->substitutions == exp->substitution_capacity)
+	{
+		int capacity = exp->substitution_capacity == 0 ? 4 : exp->substitution_capacity * 2;
+		if ((fds = realloc(exp->fds, sizeof(int) * capacity)) != NULL)
+		{
+			exp->fds = fds;
+		}
+		if ((pids = realloc(exp->pids, sizeof(pid_t) * capacity)) != NULL)
+		{
+			exp->pids = pids;
+		}
+		if (fds == NULL || pids == NULL)
+		{
+			perror("Error - Could not expand command");
+			close(line_end);
+			if (pid > 0 && wait_child(pid) == -1 && errno != ECHILD)
+			{
+				perror("Error - failed waiting for children ");
+			}
+			return 1;
+		}
+		exp->substitution_capacity = capacity;
+	}
+	// A command that could not be executed (pid 0) leaves a pipe that is at EOF, or broken
+	exp->fds[exp->substitutions] = line_end;
+	exp->pids[exp->substitutions] = pid;
+	exp->substitutions++;
+
+	path = malloc(sizeof("/dev/fd/") + 11);
+	if (path == NULL || expansion_keep(exp, path) != 0)
+	{
+		perror("Error - Could not expand command");
+		return 1;
+	}
+	sprintf(path, "/dev/fd/%d", line_end);
+	return expansion_append(exp, path);
+}
+
+// Closes the line's ends of its substitutions' pipes - so ">(...)" commands see EOF and "<(...)"
+// ones stop writing - and waits for their commands.
+void expansion_finish(struct expansion *exp)
+{
+	for (int i = 0; i < exp->substitutions; i++)
+	{
+		if (exp->fds[i] != -1)
+		{
+			close(exp->fds[i]);
+			exp->fds[i] = -1;
+		}
+	}
+	for (int i = 0; i < exp->substitutions; i++)
+	{
+		if (exp->pids[i] > 0 && wait_child(exp->pids[i]) == -1 && errno != ECHILD)
+		{
+			perror("Error - failed waiting for children ");
+		}
+		exp->pids[i] = 0;
+	}
+}
+
+void expansion_free(struct expansion *exp)
+{
+	for (int i = 0; i < exp->buffer_count; i++)
+	{
+		free(exp->buffers[i]);
+	}
+	free(exp->buffers);
+	free(exp->argv);
+	free(exp->fds);
+	free(exp->pids);
+}
+
+// Applies the prefixes at the start of arglist to line_options. Returns how many words they took,
+// or -1 (after reporting) if one has a bad argument.
+int apply_prefixes(int count, char **arglist)
+{
+	int used = 0;
+	size_t i = 0;
+
+	// Prefixes combine in any order, so the search starts over after each one
+	while (i < sizeof(prefixes) / sizeof(prefixes[0]))
+	{
+		const struct prefix *prefix = &prefixes[i++];
+		// Only a prefix when a command follows its arguments
+		if (count - used > prefix->args + 1 && strcmp(arglist[used], prefix->name) == 0)
+		{
+			if (prefix->apply(&arglist[used + 1]) != 0)
+			{
+				return -1;
+			}
+			used += prefix->args + 1;
+			i = 0;
+		}
+	}
+	return used;
+}
+
+// Waits for a foreground child and adds its status and resource usage to the line's record.
+// If it is stopped (Ctrl-Z), the whole line becomes a suspended job, and the line's other children
+// are handed to that job instead of being waited for. Returns 0 on success, -1 with errno set
+// otherwise.
+int wait_child(pid_t pid)
+{
+	struct rusage usage;
+	int status, pidfd;
+	pid_t reaped;
+	uint64_t started = trace_clock();
+	siginfo_t info;
+
+	if (line_group.job != NULL)
+	{
+		return job_add_process(line_group.job, pid) == 0 ? 0 : -1;
+	}
+
+	// While background jobs run, wait in the event loop so they are reaped (and queued ones
+	// started) as they exit instead of after this child. Jobs without a pidfd are only found by
+	// polling, so those make it a plain wait.
+	if (events_wanted() && jobs.unwatched == 0 &&
+		(pidfd = syscall(SYS_pidfd_open, pid, 0)) != -1)
+	{
+		struct epoll_event event = {.events = EPOLLIN, .data.fd = pidfd};
+		if (epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, pidfd, &event) == 0)
+		{
+			// A pidfd only reports the exit, so look for a stop after every event
+			while (!run_events(pidfd, -1) &&
+				   !(waitid(P_PID, pid, &info, WSTOPPED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid))
+			{
+			}
+			epoll_ctl(events.epoll_fd, EPOLL_CTL_DEL, pidfd, NULL);
+		}
+		close(pidfd);
+	}
+	while ((reaped = wait4(pid, &status, WUNTRACED, &usage)) == -1 && errno == EINTR)
+	{
+	}
+	if (reaped == -1)
+	{
+		return -1;
+	}
+	if (WIFSTOPPED(status))
+	{
+		if (job_suspend_line() == NULL || job_add_process(line_group.job, pid) != 0)
+		{
+			// It cannot be tracked as a job, so it cannot stay stopped either
+			killpg(line_group.pgid, SIGCONT);
+			return wait_child(pid);
+		}
+		return 0;
+	}
+	timeout_untrack(pid);
+	if (trace.out != NULL)
+	{
+		char detail[32];
+		snprintf(detail, sizeof(detail), "pid %d", (int)pid);
+		trace_span("wait", "wait", trace.shell, started, detail);
+		trace_process_end(pid, status);
+	}
+	stats_log_reaped(pid, status, &usage);
+	record_process(&line_record, status, &usage);
+	return 0;
+}
+
+// Starts a record of the command line argv[0..count) (the words, before any are cut).
+void record_start(struct command_record *record, int count, char **argv)
+{
+	size_t used = 0;
+
+	record->command[0] = '\0';
+	for (int i = 0; i < count && used < sizeof(record->command) - 1; i++)
+	{
+		int n = snprintf(record->command + used, sizeof(record->command) - used, i == 0 ? "%s" : " %s", argv[i]);
+		used += n < 0 ? 0 : (size_t)n;
+	}
+	memset(&record->usage, 0, sizeof(record->usage));
+	record->status = 0;
+	record->processes = 0;
+	record->real = 0;
+	clock_gettime(CLOCK_MONOTONIC, &record->started);
+}
+
+void record_process(struct command_record *record, int status, const struct rusage *usage)
+{
+	add_usage(&record->usage, usage);
+	record->status = status;
+	record->processes++;
+}
+
+// Adds one process's usage to total - times and counters add up, the peak RSS is the highest.
+void add_usage(struct rusage *total, const struct rusage *usage)
+{
+	timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+	timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+	if (usage->ru_maxrss > total->ru_maxrss)
+	{
+		total->ru_maxrss = usage->ru_maxrss;
+	}
+	total->ru_minflt += usage->ru_minflt;
+	total->ru_majflt += usage->ru_majflt;
+	total->ru_inblock += usage->ru_inblock;
+	total->ru_oublock += usage->ru_oublock;
+	total->ru_nvcsw += usage->ru_nvcsw;
+	total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+// Stops the record's clock and keeps it in the history if any process of it was reaped.
+void record_finish(struct command_record *record)
+{
+	struct timespec now;
+	struct command_history *history = &command_history;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record->real = (now.tv_sec - record->started.tv_sec) + (now.tv_nsec - record->started.tv_nsec) / 1e9;
+	if (record->processes == 0)
+	{
+		return;
+	}
+	if (history->capacity == 0)
+	{
+		return;
+	}
+	if (history->records == NULL)
+	{
+		history->records = malloc(sizeof(struct command_record) * history->capacity);
+		if (history->records == NULL)
+		{
+			return;
+		}
+	}
+	history->records[history->next] = *record;
+	history->next = (history->next + 1) % history->capacity;
+	if (history->count < history->capacity)
+	{
+		history->count++;
+	}
+}
+
+void print_record_row(const struct command_record *record)
+{
+	char state[32];
+
+	if (WIFSIGNALED(record->status))
+	{
+		snprintf(state, sizeof(state), "signal %d", WTERMSIG(record->status));
+	}
+	else
+	{
+		snprintf(state, sizeof(state), "exit %d", WEXITSTATUS(record->status));
+	}
+	printf("%9.3f %9ld.%03ld %9ld.%03ld %10ld %8ld %8ld  %-9s %s\n", record->real, (long)record->usage.ru_utime.tv_sec,
+		   (long)record->usage.ru_utime.tv_usec / 1000, (long)record->usage.ru_stime.tv_sec,
+		   (long)record->usage.ru_stime.tv_usec / 1000, record->usage.ru_maxrss, record->usage.ru_nvcsw,
+		   record->usage.ru_nivcsw, state, record->command);
+}
+
+int prefix_time(char **args)
+{
+	(void)args;
+	line_options.time = 1;
+	return 0;
+}
+
+// rusage          - what each of the last commands cost, oldest first
+// rusage -s [n]   - the n slowest of them by real time
+// rusage -n size  - keep the last size commands from now on (0 - none)
+int builtin_rusage(int count, char **arglist)
+{
+	struct command_history *history = &command_history;
+	int oldest = (history->next - history->count + history->capacity) % (history->capacity == 0 ? 1 : history->capacity);
+	int shown = history->count;
+	struct command_record **order;
+
+	if (count == 3 && strcmp(arglist[1], "-n") == 0)
+	{
+		int capacity = atoi(arglist[2]);
+		if (capacity < 0)
+		{
+			fprintf(stderr, "rusage: %s: not a size\n", arglist[2]);
+			return 1;
+		}
+		// Starting over is simpler than moving a ring, and a resize is rare
+		free(history->records);
+		*history = (struct command_history){.capacity = capacity};
+		return 1;
+	}
+	if (count > 1 && strcmp(arglist[1], "-s") != 0)
+	{
+		fprintf(stderr, "usage: rusage [-s [n] | -n size]\n");
+		return 1;
+	}
+	order = malloc(sizeof(struct command_record *) * (history->count + 1));
+	if (order == NULL)
+	{
+		perror("rusage");
+		return 1;
+	}
+	for (int i = 0; i < history->count; i++)
+	{
+		order[i] = &history->records[(oldest + i) % history->capacity];
+	}
+	if (count > 1)
+	{
+		// Selection of the slowest - n is small
+		shown = count > 2 ? atoi(arglist[2]) : SLOWEST_DEFAULT;
+		shown = shown < 0 ? 0 : shown > history->count ? history->count : shown;
+		for (int i = 0; i < shown; i++)
+		{
+			for (int j = i + 1; j < history->count; j++)
+			{
+				if (order[j]->real > order[i]->real)
+				{
+					struct command_record *swap = order[i];
+					order[i] = order[j];
+					order[j] = swap;
+				}
+			}
+		}
+	}
+	printf("%9s %13s %13s %10s %8s %8s  %-9s %s\n", "real", "user", "sys", "maxrss_kb", "vcsw", "ivcsw", "status", "command");
+	for (int i = 0; i < shown; i++)
+	{
+		print_record_row(order[i]);
+	}
+	fflush(stdout);
+	free(order);
+	return 1;
+}
+
+// Opens (creating it if needed) the stats log at path and maps it. Returns 0 on success, 1 (after
+// reporting) otherwise - the shell then runs without it.
+int stats_log_open(const char *path)
+{
+	struct stats_header header = {.magic = STATS_MAGIC, .header_size = 64, .entry_size = sizeof(struct stats_entry)};
+	struct stat st;
+	int ok;
+
+	stats_log.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (stats_log.fd == -1)
+	{
+		perror("Error - Could not open the stats log");
+		return 1;
+	}
+	// Another shell may be creating it right now
+	flock(stats_log.fd, LOCK_EX);
+	ok = fstat(stats_log.fd, &st) == 0;
+	if (ok && st.st_size == 0)
+	{
+		ok = ftruncate(stats_log.fd, STATS_GROW) == 0 && pwrite(stats_log.fd, &header, sizeof(header), 0) == sizeof(header);
+		st.st_size = STATS_GROW;
+	}
+	flock(stats_log.fd, LOCK_UN);
+	// Too short for a header - not a log, and nothing is mapped to check
+	ok = ok && (size_t)st.st_size >= sizeof(header) && stats_log_map(st.st_size) == 0;
+	if (!ok || memcmp(stats_log.map->magic, STATS_MAGIC, sizeof(header.magic)) != 0 ||
+		stats_log.map->entry_size != sizeof(struct stats_entry) || stats_log.map->header_size < sizeof(header))
+	{
+		fprintf(stderr, "Error - %s is not a usable stats log\n", path);
+		stats_log_close();
+		return 1;
+	}
+	return 0;
+}
+
+// Maps the first size bytes of the stats log, growing the file if it is shorter.
+// Returns 0 on success, 1 otherwise.
+int stats_log_map(size_t size)
+{
+	struct stat st;
+	void *map;
+
+	flock(stats_log.fd, LOCK_EX);
+	if (fstat(stats_log.fd, &st) == -1)
+	{
+		flock(stats_log.fd, LOCK_UN);
+		return 1;
+	}
+	if ((size_t)st.st_size < size)
+	{
+		// Only ever grows, and to a multiple of STATS_GROW, so racing shells agree
+		size_t grown = (size + STATS_GROW - 1) / STATS_GROW * STATS_GROW;
+		if (ftruncate(stats_log.fd, grown) == -1)
+		{
+			flock(stats_log.fd, LOCK_UN);
+			return 1;
+		}
+		st.st_size = grown;
+	}
+	flock(stats_log.fd, LOCK_UN);
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, stats_log.fd, 0);
+	if (map == MAP_FAILED)
+	{
+		return 1;
+	}
+	if (stats_log.map != NULL)
+	{
+		munmap(stats_log.map, stats_log.mapped);
+	}
+	stats_log.map = map;
+	stats_log.mapped = st.st_size;
+	return 0;
+}
+
+// Notes a child just started as command, so its entry can be written when it is reaped.
+void stats_log_spawned(pid_t pid, const char *command)
+{
+	struct stats_pending *process;
+	const char *name = strrchr(command, '/');
+
+	if (stats_log.map == NULL)
+	{
+		return;
+	}
+	if (stats_log.pending_count == stats_log.pending_capacity)
+	{
+		int capacity = stats_log.pending_capacity == 0 ? 16 : stats_log.pending_capacity * 2;
+		struct stats_pending *pending = realloc(stats_log.pending, sizeof(struct stats_pending) * capacity);
+		if (pending == NULL)
+		{
+			// It just goes unlogged
+			return;
+		}
+		stats_log.pending = pending;
+		stats_log.pending_capacity = capacity;
+	}
+	process = &stats_log.pending[stats_log.pending_count++];
+	process->pid = pid;
+	clock_gettime(CLOCK_MONOTONIC, &process->started);
+	// The name is argv[0] without its directory
+	snprintf(process->name, sizeof(process->name), "%s", name != NULL ? name + 1 : command);
+}
+
+// Writes the entry of a reaped child noted by stats_log_spawned. Few children run at once, so the
+// pending ones are searched in order.
+void stats_log_reaped(pid_t pid, int status, const struct rusage *usage)
+{
+	for (int i = 0; i < stats_log.pending_count; i++)
+	{
+		if (stats_log.pending[i].pid == pid)
+		{
+			stats_log_append(&stats_log.pending[i], status, usage);
+			stats_log.pending[i] = stats_log.pending[--stats_log.pending_count];
+			return;
+		}
+	}
+}
+
+void stats_log_append(const struct stats_pending *process, int status, const struct rusage *usage)
+{
+	uint64_t slot = __atomic_fetch_add(&stats_log.map->records, 1, __ATOMIC_RELAXED);
+	size_t end = stats_log.map->header_size + (slot + 1) * sizeof(struct stats_entry);
+	size_t len = strlen(process->name);
+	struct stats_entry *entry;
+	struct timespec now;
+
+	if (end > stats_log.mapped && stats_log_map(end) != 0)
+	{
+		return;
+	}
+	entry = (struct stats_entry *)((char *)stats_log.map + stats_log.map->header_size) + slot;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	entry->duration_ns = (now.tv_sec - process->started.tv_sec) * 1000000000ull + now.tv_nsec - process->started.tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &now);
+	entry->finished_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+	entry->max_rss_kb = usage->ru_maxrss;
+	entry->status = status;
+	if (len == 0)
+	{
+		// A reader skips it
+		return;
+	}
+	memcpy(entry->name + 1, process->name + 1, len);
+	// name[0] goes last: a reader skips slots whose name is still empty, and once it is not,
+	// everything above is visible to it
+	__atomic_store_n(&entry->name[0], process->name[0], __ATOMIC_RELEASE);
+}
+
+void stats_log_close(void)
+{
+	if (stats_log.map != NULL)
+	{
+		munmap(stats_log.map, stats_log.mapped);
+	}
+	if (stats_log.fd != -1)
+	{
+		close(stats_log.fd);
+	}
+	free(stats_log.pending);
+	stats_log = (struct stats_log){.fd = -1};
+}
+
+// Starts the trace at path. Returns 0 on success, 1 (after reporting) otherwise.
+int trace_open(const char *path)
+{
+	trace.out = fopen(path, "we");
+	if (trace.out == NULL)
+	{
+		perror("Error - Could not open the trace");
+		return 1;
+	}
+	trace.shell = getpid();
+	fputs("[\n", trace.out);
+	trace_event("M", "process_name", "__metadata", trace.shell, 0);
+	fputs(",\"args\":{\"name\":\"myshell\"}}", trace.out);
+	trace_event("M", "thread_name", "__metadata", trace.shell, 0);
+	fputs(",\"args\":{\"name\":\"shell\"}}", trace.out);
+	return 0;
+}
+
+// Now in nanoseconds, or 0 when nothing is traced (so untraced lines skip the clock).
+uint64_t trace_clock(void)
+{
+	struct timespec now;
+
+	if (trace.out == NULL)
+	{
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Writes the fields every event shares, leaving the object open for the rest.
+void trace_event(const char *phase, const char *name, const char *category, pid_t track, uint64_t ts)
+{
+	fprintf(trace.out, "%s{\"ph\":\"%s\",\"name\":", trace.events++ > 0 ? ",\n" : "", phase);
+	trace_string(name);
+	fprintf(trace.out, ",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", category, (int)trace.shell, (int)track, ts / 1e3);
+}
+
+// Writes s as a JSON string.
+void trace_string(const char *s)
+{
+	fputc('"', trace.out);
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"' || *s == '\\')
+		{
+			fprintf(trace.out, "\\%c", *s);
+		}
+		else if ((unsigned char)*s < 0x20)
+		{
+			fprintf(trace.out, "\\u%04x", *s);
+		}
+		else
+		{
+			fputc(*s, trace.out);
+		}
+	}
+	fputc('"', trace.out);
+}
+
+// Records that the work name took from start until now on track, with an optional detail.
+void trace_span(const char *name, const char *category, pid_t track, uint64_t start, const char *detail)
+{
+	if (trace.out == NULL)
+	{
+		return;
+	}
+	trace_event("X", name, category, track, start);
+	fprintf(trace.out, ",\"dur\":%.3f", (trace_clock() - start) / 1e3);
+	if (detail != NULL)
+	{
+		fputs(",\"args\":{\"detail\":", trace.out);
+		trace_string(detail);
+		fputc('}', trace.out);
+	}
+	fputc('}', trace.out);
+}
+
+// Opens pid's track, named after its command, with a span that lasts until it is reaped.
+void trace_process_start(pid_t pid, char **argv)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%d %s", (int)pid, argv[0]);
+	trace_event("M", "thread_name", "__metadata", pid, 0);
+	fputs(",\"args\":{\"name\":", trace.out);
+	trace_string(name);
+	fputs("}}", trace.out);
+	trace_event("B", argv[0], "exec", pid, trace_clock());
+	fputc('}', trace.out);
+}
+
+// Closes pid's span and marks on the shell's track where it was reaped.
+void trace_process_end(pid_t pid, int status)
+{
+	uint64_t now = trace_clock();
+
+	if (trace.out == NULL)
+	{
+		return;
+	}
+	trace_event("E", "", "exec", pid, now);
+	fprintf(trace.out, ",\"args\":{\"status\":%d}}", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+	trace_event("i", "reap", "reap", trace.shell, now);
+	fprintf(trace.out, ",\"s\":\"t\",\"args\":{\"pid\":%d}}", (int)pid);
+}
+
+void trace_close(void)
+{
+	if (trace.out != NULL)
+	{
+		fputs("\n]\n", trace.out);
+		fclose(trace.out);
+		trace.out = NULL;
+	}
+}
+
+int histogram_index(uint64_t us)
+{
+	int msb;
+
+	if (us < (2u << HIST_SUB_BITS))
+	{
+		return (int)us;
+	}
+	if (us >> (HIST_MAX_MSB + 1) != 0)
+	{
+		us = (2ull << HIST_MAX_MSB) - 1;
+	}
+	msb = 63 - __builtin_clzll(us);
+	return ((msb - HIST_SUB_BITS) << HIST_SUB_BITS) + (int)(us >> (msb - HIST_SUB_BITS));
+}
+
+// The middle of the range of durations that fall into bucket index.
+uint64_t histogram_value(int index)
+{
+	int shift;
+	uint64_t base;
+
+	if (index < (2 << HIST_SUB_BITS))
+	{
+		return index;
+	}
+	shift = (index >> HIST_SUB_BITS) - 1;
+	base = (uint64_t)(index - (shift << HIST_SUB_BITS)) << shift;
+	return base + ((1ull << shift) >> 1);
+}
+
+uint64_t histogram_percentile(const struct command_stats *stats, double percentile)
+{
+	uint64_t rank = (uint64_t)(percentile * stats->count + 0.5), seen = 0;
+
+	rank = rank < 1 ? 1 : rank;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += stats->histogram[i];
+		if (seen >= rank)
+		{
+			// Never report more than was seen
+			return histogram_value(i) < stats->max_us ? histogram_value(i) : stats->max_us;
+		}
+	}
+	return stats->max_us;
+}
+
+// Returns name's slot in an open-addressing table of capacity slots (a power of two): its entry,
+// or the empty slot (name[0] == '\0') where it goes.
+struct command_stats *stats_slot(struct command_stats *table, size_t capacity, const char *name)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (const char *p = name; *p != '\0'; p++)
+	{
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+	}
+	for (i = hash & (capacity - 1); table[i].name[0] != '\0' && strcmp(table[i].name, name) != 0; i = (i + 1) & (capacity - 1))
+	{
+	}
+	return &table[i];
+}
+
+int compare_total_time(const void *a, const void *b)
+{
+	const struct command_stats *x = a, *y = b;
+	return (x->total_us < y->total_us) - (x->total_us > y->total_us);
+}
+
+// stats          - for every command name in the stats log: runs, failures, duration percentiles,
+//                  total time and peak RSS, the most time-consuming first
+// stats name ... - only these commands
+int builtin_stats(int count, char **arglist)
+{
+	struct command_stats *table, *sorted;
+	size_t capacity = 64, used = 0, records;
+	const struct stats_entry *entries;
+
+	if (stats_log.map == NULL)
+	{
+		fprintf(stderr, "stats: no stats log - set MYSHELL_STATS_LOG to a file before starting the shell\n");
+		return 1;
+	}
+	// Other shells may have appended past what is mapped here
+	records = __atomic_load_n(&stats_log.map->records, __ATOMIC_ACQUIRE);
+	if (stats_log.map->header_size + records * sizeof(struct stats_entry) > stats_log.mapped &&
+		stats_log_map(stats_log.map->header_size + records * sizeof(struct stats_entry)) != 0)
+	{
+		perror("stats");
+		return 1;
+	}
+	entries = (const struct stats_entry *)((const char *)stats_log.map + stats_log.map->header_size);
+	table = calloc(capacity, sizeof(struct command_stats));
+	if (table == NULL)
+	{
+		perror("stats");
+		return 1;
+	}
+	for (size_t r = 0; r < records; r++)
+	{
+		const struct stats_entry *entry = &entries[r];
+		struct command_stats *stats;
+		uint64_t us = entry->duration_ns / 1000;
+		int wanted = count == 1;
+
+		if (__atomic_load_n(&entry->name[0], __ATOMIC_ACQUIRE) == '\0')
+		{
+			continue;
+		}
+		for (int i = 1; i < count && !wanted; i++)
+		{
+			wanted = strncmp(arglist[i], entry->name, STATS_NAME_MAX) == 0;
+		}
+		if (!wanted)
+		{
+			continue;
+		}
+		if (used * 2 >= capacity)
+		{
+			struct command_stats *grown = calloc(capacity * 2, sizeof(struct command_stats));
+			if (grown == NULL)
+			{
+				break;
+			}
+			for (size_t i = 0; i < capacity; i++)
+			{
+				if (table[i].name[0] != '\0')
+				{
+					*stats_slot(grown, capacity * 2, table[i].name) = table[i];
+				}
+			}
+			free(table);
+			table = grown;
+			capacity *= 2;
+		}
+		stats = stats_slot(table, capacity, entry->name);
+		if (stats->name[0] == '\0')
+		{
+			stats->histogram = calloc(HIST_BUCKETS, sizeof(uint32_t));
+			if (stats->histogram == NULL)
+			{
+				break;
+			}
+			memcpy(stats->name, entry->name, STATS_NAME_MAX);
+			stats->name[STATS_NAME_MAX - 1] = '\0';
+			used++;
+		}
+		stats->count++;
+		stats->failures += entry->status != 0;
+		stats->total_us += us;
+		stats->max_us = us > stats->max_us ? us : stats->max_us;
+		stats->max_rss_kb = entry->max_rss_kb > stats->max_rss_kb ? entry->max_rss_kb : stats->max_rss_kb;
+		stats->histogram[histogram_index(us)]++;
+	}
+
+	// Only the used slots are sorted - empty ones would tie with commands that took no time
+	sorted = malloc(sizeof(struct command_stats) * (used > 0 ? used : 1));
+	if (sorted == NULL)
+	{
+		perror("stats");
+		used = 0;
+	}
+	for (size_t i = 0, n = 0; sorted != NULL && i < capacity; i++)
+	{
+		if (table[i].name[0] != '\0')
+		{
+			sorted[n++] = table[i];
+		}
+	}
+	if (used > 0)
+	{
+		qsort(sorted, used, sizeof(struct command_stats), compare_total_time);
+	}
+	printf("%-20s %8s %6s %10s %10s %10s %10s %10s %10s\n", "command", "count", "fail", "p50_ms", "p95_ms", "p99_ms",
+		   "max_ms", "total_s", "maxrss_kb");
+	for (size_t i = 0; i < used; i++)
+	{
+		const struct command_stats *stats = &sorted[i];
+		printf("%-20s %8llu %6llu %10.3f %10.3f %10.3f %10.3f %10.3f %10lld\n", stats->name,
+			   (unsigned long long)stats->count, (unsigned long long)stats->failures,
+			   histogram_percentile(stats, 0.50) / 1e3, histogram_percentile(stats, 0.95) / 1e3,
+			   histogram_percentile(stats, 0.99) / 1e3, stats->max_us / 1e3, stats->total_us / 1e6,
+			   (long long)stats->max_rss_kb);
+	}
+	fflush(stdout);
+	free(sorted);
+	for (size_t i = 0; i < capacity; i++)
+	{
+		free(table[i].histogram);
+	}
+	free(table);
+	return 1;
+}
+
+// Classifies every word of arglist into cmd in a single scan. Returns 0 on success, 1 on failure.
+int parse_command(struct parsed_command *cmd, int count, char **arglist)
+{
+	if (count > cmd->kinds_capacity)
+	{
+		int capacity = cmd->kinds_capacity == 0 ? 64 : cmd->kinds_capacity;
+		while (capacity < count)
+		{
+			capacity *= 2;
+		}
+		unsigned char *kinds = realloc(cmd->kinds, capacity);
+		if (kinds == NULL)
+		{
+			return 1;
+		}
+		cmd->kinds = kinds;
+		cmd->kinds_capacity = capacity;
+	}
+	cmd->count = count;
+	cmd->argv = arglist;
+	cmd->background = -1;
+	cmd->redirects = 0;
+	cmd->pipes = 0;
+	cmd->shards = 0;
+	cmd->fan_outs = 0;
+	for (int i = 0; i < count; i++)
+	{
+		enum token_kind kind = classify_token(arglist[i]);
+		cmd->kinds[i] = kind;
+		if (kind == TOKEN_WORD)
+		{
+			continue;
+		}
+		if (kind == TOKEN_BACKGROUND && cmd->background == -1)
+		{
+			cmd->background = i;
+		}
+		cmd->redirects += is_redirect(kind);
+		cmd->pipes += is_stage_separator(kind);
+		cmd->shards += (kind == TOKEN_SHARD);
+		cmd->fan_outs += (kind == TOKEN_FAN_OUT);
+	}
+	return 0;
+}
+
+enum token_kind classify_token(const char *word)
+{
+	enum token_kind kind = operator_table[(unsigned char)word[0]];
+	if (word[0] == '2' && word[1] == '>')
+	{
+		// The stderr forms - "2>", "2>>" and "2>&1"
+		if (word[2] == '\0')
+		{
+			return TOKEN_REDIRECT_ERR;
+		}
+		if (word[2] == '>' && word[3] == '\0')
+		{
+			return TOKEN_APPEND_ERR;
+		}
+		return strcmp(word + 2, "&1") == 0 ? TOKEN_ERR_TO_OUT : TOKEN_WORD;
+	}
+	if (kind == TOKEN_WORD || word[1] == '\0')
+	{
+		return kind;
+	}
+	if (kind == TOKEN_REDIRECT_OUT && word[1] == '>' && word[2] == '\0')
+	{
+		return TOKEN_APPEND;
+	}
+	if (kind == TOKEN_REDIRECT_IN && word[1] == '<')
+	{
+		return word[2] == '<' ? TOKEN_HERESTRING : TOKEN_HEREDOC;
+	}
+	if (kind == TOKEN_REDIRECT_OUT && word[1] == '&' && word[2] == '2' && word[3] == '\0')
+	{
+		return TOKEN_OUT_TO_ERR;
+	}
+	if (kind == TOKEN_PIPE && word[1] == '&' && word[2] == '\0')
+	{
+		return TOKEN_FAN_OUT;
+	}
+	if (kind == TOKEN_PIPE && parse_shard(word, NULL) == 0)
+	{
+		return TOKEN_SHARD;
+	}
+	return TOKEN_WORD;
+}
+
+int run_process_background(struct parsed_command *cmd, int op)
+{
+	struct spawn_request req;
+	cmd->argv[op] = NULL;
+	pid_t pid = -1;
+	// Jobs already waiting go first, and no more than jobs.slots run at once
+	int queue = jobs.queued > 0 || job_slots_full();
+	init_spawn_request(&req, cmd->argv, 0, "Error - Could not execute child process");
+	if (!queue)
+	{
+		// A queued job keeps its redirections in its words and opens the files once it starts
+		if (cmd->redirects > 0)
+		{
+			if (redirect_plan_build(&redirect_plan, cmd->argv, cmd->kinds, req.fds, &line_heredocs) != 0)
+			{
+				return 1;
+			}
+			req.argv = redirect_plan.argv;
+			memcpy(req.fds, redirect_plan.fds, sizeof(req.fds));
+		}
+		pid = spawn_process(&req);
+		queue = pid == -1 && spawn_is_exhausted(errno);
+		redirect_plan_close(&redirect_plan);
+	}
+	if (queue)
+	{
+		// Start it when a background job exits instead of stalling the shell
+		if (job_queue(cmd->argv) == NULL)
+		{
+			perror("Error - Could not queue background job");
+		}
+		return 1;
+	}
+	if (pid == -1)
+	{
+		perror("Failed during forking");
+		return 1;
+	}
+	if (pid > 0 && job_add(pid, cmd->argv) == NULL)
+	{
+		perror("Error - Could not record background job");
+	}
+	return 1;
+}
+
+// Starts the pipeline before op as a single background job with a process per stage, in a group
+// of its own. Stages start right away - the job queue only holds single commands.
+int run_pipeline_background(struct parsed_command *cmd, int op)
+{
+	struct job *job;
+	int ret;
+
+	if (cmd->shards + cmd->fan_outs > 0)
+	{
+		// The shell itself relays between those stages, so it would have to stay in the foreground
+		fprintf(stderr, "Error - a pipeline with |N| or |& cannot run in the background\n");
+		return 1;
+	}
+	cmd->argv[op] = NULL;
+	cmd->count = op;
+	job = job_create(cmd->argv);
+	if (job == NULL)
+	{
+		perror("Error - Could not record background job");
+		return 1;
+	}
+	job->state = JOB_RUNNING;
+	clock_gettime(CLOCK_MONOTONIC, &job->started);
+	jobs.running++;
+	// wait_child hands the stages to the job instead of waiting for them
+	line_group.job = job;
+	ret = pipe_it_up(cmd);
+	job->pgid = line_group.pgid;
+	if (job->processes == NULL)
+	{
+		// No stage could be started (already reported)
+		jobs.running--;
+		job_remove(job);
+		line_group.job = NULL;
+	}
+	return ret;
+}
+
+int pipe_it_up(struct parsed_command *cmd)
+{
+	// Runs every stage of "cmd1 | cmd2 | ... | cmdN", stage k's stdout piped to stage k+1's stdin.
+	// The stage after a "|N|" runs as N copies connected through a shard relay in the shell, and the
+	// last stage may be "|& a, b, c" - several consumers that all get the whole output.
+	// All stages are started before any is waited for, unless the first cannot be executed.
+	char **arglist = cmd->argv;
+	int count = cmd->count;
+	int stages = cmd->pipes + 1, started = 0, ret = 1, processes = stages;
+	int prev_read = -1, start = 0, end;
+	int pipefd[2];
+	struct spawn_request req;
+	struct shard_relay relay = {.in = -1, .out = -1};
+	struct fan_out fan = {.in = -1, .window = {-1, -1}};
+	pid_t *pids;
+
+	// Reject empty stages ("| cmd", "cmd |", "a | | b") before starting anything, and redirections
+	// of the copies or consumers the shell relays to, which all share one command line
+	for (int j = 0, relayed = 0; j < count; j++)
+	{
+		if (is_stage_separator(cmd->kinds[j]) && (j == 0 || j == count - 1 || is_stage_separator(cmd->kinds[j - 1])))
+		{
+			fprintf(stderr, "Error - empty command in pipeline\n");
+			return 1;
+		}
+		if (is_stage_separator(cmd->kinds[j]))
+		{
+			relayed = cmd->kinds[j] != TOKEN_PIPE;
+		}
+		if (relayed && is_redirect(cmd->kinds[j]))
+		{
+			fprintf(stderr, "Error - the commands after |N| or |& cannot be redirected\n");
+			return 1;
+		}
+	}
+	if (cmd->shards + cmd->fan_outs > 1)
+	{
+		fprintf(stderr, "Error - only one |N| or |& per pipeline\n");
+		return 1;
+	}
+	for (int j = 0; cmd->fan_outs == 1 && j < count; j++)
+	{
+		if (cmd->kinds[j] == TOKEN_FAN_OUT)
+		{
+			if (parse_fan_out(cmd, j, &fan) != 0)
+			{
+				fan_out_close(&fan);
+				return 1;
+			}
+			processes += fan.consumers - 1;
+		}
+	}
+	for (int j = 0; cmd->shards == 1 && j < count; j++)
+	{
+		if (cmd->kinds[j] == TOKEN_SHARD)
+		{
+			parse_shard(arglist[j], &relay);
+			processes += relay.copies - 1;
+		}
+	}
+	if (cmd->shards == 1 && shard_relay_alloc(&relay) != 0)
+	{
+		perror("Error - could not allocate pipeline");
+		shard_relay_close(&relay);
+		fan_out_close(&fan);
+		return 0;
+	}
+	pids = malloc(sizeof(pid_t) * processes);
+	if (pids == NULL)
+	{
+		perror("Error - could not allocate pipeline");
+		shard_relay_close(&relay);
+		fan_out_close(&fan);
+		return 0;
+	}
+
+	for (int k = 0; k < stages; k++)
+	{
+		for (end = start; end < count && !is_stage_separator(cmd->kinds[end]); end++)
+		{
+		}
+		arglist[end] = NULL; // Split arglist - the last stage already ends at arglist[count]
+
+		pipefd[0] = pipefd[1] = -1;
+		// Close-on-exec, so each child only keeps the ends it dup2'd onto stdin/stdout.
+		if (k < stages - 1 && open_pipe(pipefd) == -1)
+		{
+			perror("Error - could not create pipe");
+			ret = 0;
+			break;
+		}
+		if (start > 0 && cmd->kinds[start - 1] == TOKEN_SHARD)
+		{
+			// The shell reads the previous stage's output and writes this stage's
+			relay.in = prev_read;
+			relay.out = pipefd[1] != -1 ? pipefd[1] : STDOUT_FILENO;
+			relay.close_out = pipefd[1] != -1;
+			prev_read = pipefd[0];
+			started += start_shard_copies(&relay, &arglist[start], &pids[started]);
+			if (started < k + relay.copies)
+			{
+				break;
+			}
+			start = end + 1;
+			continue;
+		}
+		if (start > 0 && cmd->kinds[start - 1] == TOKEN_FAN_OUT)
+		{
+			// The last stage - the shell tees the previous stage's output to every consumer
+			fan.in = prev_read;
+			prev_read = -1;
+			started += start_fan_out_consumers(&fan, &pids[started]);
+			break;
+		}
+		// A background pipeline's stages never take the terminal
+		init_spawn_request(&req, &arglist[start], line_group.job == NULL, "Error - while executing command");
+		req.fds[STDIN_FILENO] = prev_read;
+		req.fds[STDOUT_FILENO] = pipefd[1];
+		if (cmd->redirects > 0)
+		{
+			// A stage's own redirections win over the pipes ("cmd < file | ..." reads the file)
+			if (redirect_plan_build(&redirect_plan, &arglist[start], &cmd->kinds[start], req.fds, &line_heredocs) != 0)
+			{
+				req.argv = NULL;
+			}
+			else
+			{
+				req.argv = redirect_plan.argv;
+				memcpy(req.fds, redirect_plan.fds, sizeof(req.fds));
+			}
+		}
+		// A stage that cannot be redirected is not run, as if it could not be executed
+		pids[started] = req.argv != NULL ? spawn_admitted(&req) : 0;
+		redirect_plan_close(&redirect_plan);
+
+		// The parent keeps only the read end the next stage needs
+		if (prev_read != -1)
+		{
+			close(prev_read);
+		}
+		if (pipefd[1] != -1)
+		{
+			close(pipefd[1]);
+		}
+		prev_read = pipefd[0];
+
+		if (pids[started] == -1)
+		{
+			// The stages already started see EOF or EPIPE and finish on their own
+			perror("Failed during forking");
+			break;
+		}
+		started++;
+		if (k == 0 && pids[0] == 0)
+		{
+			// The producer could not be executed (already reported) - the rest would only read EOF
+			break;
+		}
+		start = end + 1;
+	}
+	if (prev_read != -1)
+	{
+		close(prev_read);
+	}
+	line_group.relaying = 1;
+	if (cmd->shards == 1 && started == processes)
+	{
+		shard_relay_run(&relay);
+	}
+	if (cmd->fan_outs == 1 && started == processes)
+	{
+		fan_out_run(&fan);
+	}
+	line_group.relaying = 0;
+	// Closing whatever the relay still holds lets a partly started pipeline finish
+	shard_relay_close(&relay);
+	fan_out_close(&fan);
+
+	// Wait for every started stage to finish
+	if (current_pipe_sizing()->adaptive && started > 1 && line_group.job == NULL)
+	{
+		ret &= watch_pipeline(pids, started);
+	}
+	for (int k = 0; k < started; k++)
+	{
+		if (pids[k] > 0 && wait_child(pids[k]) == -1 && errno != ECHILD)
+		{
+			perror("failure during waitpid");
+			ret = 0;
+		}
+	}
+	free(pids);
+	return ret;
+}
+
+int is_stage_separator(enum token_kind kind)
+{
+	return kind == TOKEN_PIPE || kind == TOKEN_SHARD || kind == TOKEN_FAN_OUT;
+}
+
+// Parses a shard operator: "|N|" runs the next stage as N copies (1 to SHARD_MAX_COPIES), with
+// optional flags before the closing '|' - 'k' deals lines by the hash of their first field
+// instead of round-robin, 'o' merges the copies' output back in input order ("|4ko|").
+// Fills relay's settings if it is not NULL. Returns 0 if word is a shard operator, 1 otherwise.
+int parse_shard(const char *word, struct shard_relay *relay)
+{
+	const char *p = word + 1;
+	enum shard_mode mode = SHARD_ROUND_ROBIN;
+	int copies = 0, ordered = 0;
+
+	if (word[0] != '|' || !isdigit((unsigned char)*p))
+	{
+		return 1;
+	}
+	for (; isdigit((unsigned char)*p); p++)
+	{
+		copies = copies * 10 + (*p - '0');
+		if (copies > SHARD_MAX_COPIES)
+		{
+			return 1;
+		}
+	}
+	for (; *p == 'k' || *p == 'o'; p++)
+	{
+		if (*p == 'k')
+		{
+			mode = SHARD_KEY_HASH;
+		}
+		else
+		{
+			ordered = 1;
+		}
+	}
+	if (copies < 1 || p[0] != '|' || p[1] != '\0')
+	{
+		return 1;
+	}
+	if (relay != NULL)
+	{
+		relay->copies = copies;
+		relay->mode = mode;
+		relay->ordered = ordered;
+	}
+	return 0;
+}
+
+// Allocates the per-copy state of a relay whose settings parse_shard filled in.
+// Returns 0 on success, 1 on failure.
+int shard_relay_alloc(struct shard_relay *relay)
+{
+	relay->to_copy = malloc(sizeof(int) * relay->copies);
+	relay->from_copy = malloc(sizeof(int) * relay->copies);
+	relay->pending = calloc(relay->copies, sizeof(struct byte_buffer));
+	relay->output = calloc(relay->copies, sizeof(struct byte_buffer));
+	if (relay->to_copy == NULL || relay->from_copy == NULL || relay->pending == NULL || relay->output == NULL)
+	{
+		return 1;
+	}
+	for (int i = 0; i < relay->copies; i++)
+	{
+		relay->to_copy[i] = relay->from_copy[i] = -1;
+	}
+	return 0;
+}
+
+// Closes every fd the relay still holds and frees it. Safe on a relay that was never allocated.
+void shard_relay_close(struct shard_relay *relay)
+{
+	for (int i = 0; relay->to_copy != NULL && relay->from_copy != NULL && i < relay->copies; i++)
+	{
+		if (relay->to_copy[i] != -1)
+		{
+			close(relay->to_copy[i]);
+		}
+		if (relay->from_copy[i] != -1)
+		{
+			close(relay->from_copy[i]);
+		}
+	}
+	for (int i = 0; relay->pending != NULL && relay->output != NULL && i < relay->copies; i++)
+	{
+		free(relay->pending[i].data);
+		free(relay->output[i].data);
+	}
+	if (relay->in != -1)
+	{
+		close(relay->in);
+	}
+	if (relay->close_out && relay->out != -1)
+	{
+		close(relay->out);
+	}
+	free(relay->to_copy);
+	free(relay->from_copy);
+	free(relay->pending);
+	free(relay->output);
+	free(relay->carry.data);
+	free(relay->order.data);
+	free(relay->merged.data);
+	relay->to_copy = relay->from_copy = NULL;
+	relay->pending = relay->output = NULL;
+}
+
+// Starts relay->copies copies of argv, each reading a pipe the relay writes and writing a pipe the
+// relay reads. Returns how many were started; their pids are stored in pids.
+int start_shard_copies(struct shard_relay *relay, char **argv, pid_t *pids)
+{
+	struct spawn_request req;
+	int to_copy[2], from_copy[2];
+
+	for (int i = 0; i < relay->copies; i++)
+	{
+		if (open_pipe(to_copy) == -1)
+		{
+			perror("Error - could not create pipe");
+			return i;
+		}
+		if (open_pipe(from_copy) == -1)
+		{
+			perror("Error - could not create pipe");
+			close(to_copy[0]);
+			close(to_copy[1]);
+			return i;
+		}
+		init_spawn_request(&req, argv, 1, "Error - while executing command");
+		req.fds[STDIN_FILENO] = to_copy[0];
+		req.fds[STDOUT_FILENO] = from_copy[1];
+		pids[i] = spawn_admitted(&req);
+		close(to_copy[0]);
+		close(from_copy[1]);
+		relay->to_copy[i] = to_copy[1];
+		relay->from_copy[i] = from_copy[0];
+		if (pids[i] == -1)
+		{
+			perror("Failed during forking");
+			return i;
+		}
+		// A copy that could not be executed just refuses input, like one that exited
+		relay->alive++;
+	}
+	return relay->copies;
+}
+
+// Moves lines from the producer to the copies and from the copies to relay->out until every
+// copy has exited or closed its output. The shell's end of every pipe except out is non-blocking,
+// so a copy stuck writing its output can never stall the lines going to the others.
+void shard_relay_run(struct shard_relay *relay)
+{
+	struct pollfd *fds = malloc(sizeof(struct pollfd) * (2 + 2 * relay->copies));
+	int *targets = malloc(sizeof(int) * (2 + 2 * relay->copies)); // -1 - in, i - to_copy[i], copies + i - from_copy[i], -2 - events
+	void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN); // a copy that exits early must not kill the shell
+
+	if (fds == NULL || targets == NULL)
+	{
+		perror("Error - could not allocate pipeline");
+		relay->failed = 1;
+	}
+	fcntl(relay->in, F_SETFL, O_NONBLOCK);
+	for (int i = 0; i < relay->copies; i++)
+	{
+		fcntl(relay->to_copy[i], F_SETFL, O_NONBLOCK);
+		fcntl(relay->from_copy[i], F_SETFL, O_NONBLOCK);
+	}
+	while (!relay->failed)
+	{
+		int n = 0, paused = 0;
+
+		for (int i = 0; i < relay->copies; i++)
+		{
+			paused |= relay->pending[i].end - relay->pending[i].start > SHARD_HIGH_WATER;
+		}
+		if (relay->in != -1 && !paused)
+		{
+			fds[n] = (struct pollfd){relay->in, POLLIN, 0};
+			targets[n++] = -1;
+		}
+		for (int i = 0; i < relay->copies; i++)
+		{
+			int queued = relay->pending[i].end > relay->pending[i].start;
+			if (relay->in == -1 && !queued && relay->to_copy[i] != -1)
+			{
+				// Everything is delivered - the copy sees EOF
+				close(relay->to_copy[i]);
+				relay->to_copy[i] = -1;
+			}
+			if (relay->to_copy[i] != -1 && queued)
+			{
+				fds[n] = (struct pollfd){relay->to_copy[i], POLLOUT, 0};
+				targets[n++] = i;
+			}
+			if (relay->from_copy[i] != -1)
+			{
+				fds[n] = (struct pollfd){relay->from_copy[i], POLLIN, 0};
+				targets[n++] = relay->copies + i;
+			}
+		}
+		if (n == 0)
+		{
+			break;
+		}
+		if (events_wanted())
+		{
+			fds[n] = (struct pollfd){events.epoll_fd, POLLIN, 0};
+			targets[n++] = -2;
+		}
+		if (poll(fds, n, -1) == -1)
+		{
+			if (errno != EINTR)
+			{
+				perror("Error - could not relay the pipeline");
+				break;
+			}
+			continue;
+		}
+		for (int j = 0; j < n; j++)
+		{
+			if (fds[j].revents == 0)
+			{
+				continue;
+			}
+			if (targets[j] == -2)
+			{
+				run_events(-1, 0);
+			}
+			else if (targets[j] == -1)
+			{
+				shard_read_input(relay);
+			}
+			else if (targets[j] < relay->copies)
+			{
+				shard_write_copy(relay, targets[j]);
+			}
+			else
+			{
+				shard_read_output(relay, targets[j] - relay->copies);
+			}
+		}
+		shard_merge(relay, 0);
+		shard_flush(relay);
+	}
+	shard_merge(relay, 1);
+	shard_flush(relay);
+	signal(SIGPIPE, sigpipe);
+	free(fds);
+	free(targets);
+}
+
+void shard_read_input(struct shard_relay *relay)
+{
+	struct byte_buffer *carry = &relay->carry;
+	const char *last;
+	ssize_t n;
+
+	if (buffer_reserve(carry, SHARD_READ_SIZE) != 0)
+	{
+		relay->failed = 1;
+		return;
+	}
+	n = read(relay->in, carry->data + carry->end, SHARD_READ_SIZE);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+	{
+		return;
+	}
+	if (n <= 0)
+	{
+		// EOF - a last line without a newline still goes to a copy
+		close(relay->in);
+		relay->in = -1;
+		shard_distribute(relay, carry->data + carry->start, carry->end - carry->start);
+		carry->start = carry->end = 0;
+		return;
+	}
+	carry->end += n;
+	last = memrchr(carry->data + carry->start, '\n', carry->end - carry->start);
+	if (last != NULL)
+	{
+		shard_distribute(relay, carry->data + carry->start, last + 1 - (carry->data + carry->start));
+		carry->start = last + 1 - carry->data;
+	}
+}
+
+// Deals the lines in lines[0..len) out to the copies.
+void shard_distribute(struct shard_relay *relay, const char *lines, size_t len)
+{
+	const char *end = lines + len;
+
+	while (lines < end && relay->alive > 0)
+	{
+		const char *newline = memchr(lines, '\n', end - lines);
+		const char *next = newline != NULL ? newline + 1 : end;
+		int copy;
+
+		if (relay->mode == SHARD_KEY_HASH)
+		{
+			// FNV-1a of the first field; a line for a copy that is gone is dropped with it
+			uint32_t hash = 2166136261u;
+			const char *p = lines;
+			while (p < next && (*p == ' ' || *p == '\t'))
+			{
+				p++;
+			}
+			for (; p < next && *p != ' ' && *p != '\t' && *p != '\n'; p++)
+			{
+				hash = (hash ^ (unsigned char)*p) * 16777619u;
+			}
+			copy = hash % relay->copies;
+		}
+		else
+		{
+			while (relay->to_copy[relay->next] == -1)
+			{
+				relay->next = (relay->next + 1) % relay->copies;
+			}
+			copy = relay->next;
+			relay->next = (relay->next + 1) % relay->copies;
+		}
+		if (relay->to_copy[copy] != -1)
+		{
+			unsigned char id = copy;
+			if (buffer_append(&relay->pending[copy], lines, next - lines) != 0 ||
+				(relay->ordered && buffer_append(&relay->order, (const char *)&id, 1) != 0))
+			{
+				relay->failed = 1;
+				return;
+			}
+		}
+		lines = next;
+	}
+	if (relay->alive == 0 && relay->in != -1)
+	{
+		// Nobody is left to read - the producer gets EPIPE like at the end of any pipe
+		close(relay->in);
+		relay->in = -1;
+	}
+}
+
+void shard_write_copy(struct shard_relay *relay, int copy)
+{
+	struct byte_buffer *pending = &relay->pending[copy];
+	ssize_t n = write(relay->to_copy[copy], pending->data + pending->start, pending->end - pending->start);
+
+	if (n > 0)
+	{
+		pending->start += n;
+		if (pending->start == pending->end)
+		{
+			pending->start = pending->end = 0;
+		}
+		return;
+	}
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+	{
+		return;
+	}
+	// The copy exited (EPIPE) - its lines go nowhere, the others keep going
+	close(relay->to_copy[copy]);
+	relay->to_copy[copy] = -1;
+	pending->start = pending->end = 0;
+	relay->alive--;
+}
+
+void shard_read_output(struct shard_relay *relay, int copy)
+{
+	struct byte_buffer *output = &relay->output[copy];
+	ssize_t n;
+
+	if (buffer_reserve(output, SHARD_READ_SIZE) != 0)
+	{
+		relay->failed = 1;
+		return;
+	}
+	n = read(relay->from_copy[copy], output->data + output->end, SHARD_READ_SIZE);
+	if (n > 0)
+	{
+		output->end += n;
+		return;
+	}
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+	{
+		return;
+	}
+	close(relay->from_copy[copy]);
+	relay->from_copy[copy] = -1;
+}
+
+// Moves the copies' complete lines to relay->merged: in input order if the relay is ordered,
+// otherwise as they come. final also moves what is left once every copy is done.
+void shard_merge(struct shard_relay *relay, int final)
+{
+	struct byte_buffer *order = &relay->order;
+
+	while (relay->ordered && order->start < order->end)
+	{
+		int copy = (unsigned char)order->data[order->start];
+		struct byte_buffer *output = &relay->output[copy];
+		const char *newline = memchr(output->data + output->start, '\n', output->end - output->start);
+
+		if (newline != NULL)
+		{
+			size_t len = newline + 1 - (output->data + output->start);
+			if (buffer_append(&relay->merged, output->data + output->start, len) != 0)
+			{
+				relay->failed = 1;
+				return;
+			}
+			output->start += len;
+		}
+		else if (relay->from_copy[copy] != -1 && !final)
+		{
+			break;
+		}
+		// A copy that finished wrote fewer lines than it was given - skip its missing ones
+		order->start++;
+	}
+	for (int i = 0; i < relay->copies; i++)
+	{
+		struct byte_buffer *output = &relay->output[i];
+		const char *last;
+		size_t len = output->end - output->start;
+
+		if (len == 0 || (relay->ordered && !final))
+		{
+			continue;
+		}
+		if (relay->from_copy[i] != -1 && !final)
+		{
+			last = memrchr(output->data + output->start, '\n', len);
+			len = last != NULL ? (size_t)(last + 1 - (output->data + output->start)) : 0;
+		}
+		if (len > 0 && buffer_append(&relay->merged, output->data + output->start, len) != 0)
+		{
+			relay->failed = 1;
+			return;
+		}
+		output->start += len;
+	}
+}
+
+void shard_flush(struct shard_relay *relay)
+{
+	struct byte_buffer *merged = &relay->merged;
+
+	if (merged->end == merged->start)
+	{
+		return;
+	}
+	if (relay->out != -1 && write_all(relay->out, merged->data + merged->start, merged->end - merged->start) != 0)
+	{
+		// Nobody reads the output any more - stop reading the copies so they get EPIPE too
+		for (int i = 0; i < relay->copies; i++)
+		{
+			if (relay->from_copy[i] != -1)
+			{
+				close(relay->from_copy[i]);
+				relay->from_copy[i] = -1;
+			}
+		}
+		if (relay->close_out)
+		{
+			close(relay->out);
+		}
+		relay->out = -1;
+	}
+	merged->start = merged->end = 0;
+}
+
+// Splits the words after the fan-out operator at op into the consumer commands: a word ending in
+// ',' ends a command, and so does a ',' on its own. The operator must start the last stage.
+// Returns 0 on success, 1 (after reporting) otherwise.
+int parse_fan_out(struct parsed_command *cmd, int op, struct fan_out *fan)
+{
+	int words = cmd->count - op - 1, n = 0, in_command = 0;
+
+	for (int j = op + 1; j < cmd->count; j++)
+	{
+		if (is_stage_separator(cmd->kinds[j]))
+		{
+			fprintf(stderr, "Error - |& must be the last stage of a pipeline\n");
+			return 1;
+		}
+	}
+	// Room for every word plus a NULL after each command - at most one command per word
+	fan->argv = malloc(sizeof(char *) * (2 * words + 1));
+	fan->first = malloc(sizeof(int) * (words + 1));
+	if (fan->argv == NULL || fan->first == NULL)
+	{
+		perror("Error - could not allocate pipeline");
+		return 1;
+	}
+	for (int j = op + 1; j < cmd->count; j++)
+	{
+		char *word = cmd->argv[j];
+		size_t len = strlen(word);
+		int ends_command = word[len - 1] == ',';
+
+		if (ends_command)
+		{
+			word[len - 1] = '\0';
+		}
+		if (word[0] != '\0')
+		{
+			if (!in_command)
+			{
+				fan->first[fan->consumers++] = n;
+				in_command = 1;
+			}
+			fan->argv[n++] = word;
+		}
+		if (ends_command || j == cmd->count - 1)
+		{
+			if (!in_command)
+			{
+				fprintf(stderr, "Error - empty command in fan-out\n");
+				return 1;
+			}
+			fan->argv[n++] = NULL;
+			in_command = 0;
+		}
+	}
+	return 0;
+}
+
+// Starts every consumer with its own pipe for stdin. Returns how many were started; their pids
+// are stored in pids.
+int start_fan_out_consumers(struct fan_out *fan, pid_t *pids)
+{
+	struct spawn_request req;
+	int pipefd[2];
+
+	fan->to_consumer = malloc(sizeof(int) * fan->consumers);
+	if (fan->to_consumer == NULL)
+	{
+		perror("Error - could not allocate pipeline");
+		return 0;
+	}
+	for (int i = 0; i < fan->consumers; i++)
+	{
+		fan->to_consumer[i] = -1;
+	}
+	for (int i = 0; i < fan->consumers; i++)
+	{
+		if (open_pipe(pipefd) == -1)
+		{
+			perror("Error - could not create pipe");
+			return i;
+		}
+		init_spawn_request(&req, &fan->argv[fan->first[i]], 1, "Error - while executing command");
+		req.fds[STDIN_FILENO] = pipefd[0];
+		pids[i] = spawn_admitted(&req);
+		close(pipefd[0]);
+		fan->to_consumer[i] = pipefd[1];
+		if (pids[i] == -1)
+		{
+			perror("Failed during forking");
+			return i;
+		}
+	}
+	return fan->consumers;
+}
+
+// Feeds the producer's output to every consumer until it ends or no consumer is left.
+void fan_out_run(struct fan_out *fan)
+{
+	void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN); // a consumer that exits early must not kill the shell
+	size_t *teed = malloc(sizeof(size_t) * fan->consumers);
+	ssize_t chunk, n;
+
+	// A bigger window means fewer, larger chunks, so it is sized like the pipeline's pipes
+	if (teed == NULL || open_pipe(fan->window) == -1)
+	{
+		perror("Error - could not relay the pipeline");
+		signal(SIGPIPE, sigpipe);
+		free(teed);
+		return;
+	}
+	while (1)
+	{
+		int last = -1, short_tee = 0;
+		size_t moved = 0;
+
+		for (int i = 0; i < fan->consumers; i++)
+		{
+			if (fan->to_consumer[i] != -1)
+			{
+				last = i;
+			}
+		}
+		if (last == -1)
+		{
+			// Every consumer is gone - closing our end gives the producer EPIPE
+			break;
+		}
+		// Waiting in splice() or tee() would hold up a deadline, so wait in the event loop first
+		await_fd(fan->in, POLLIN);
+		while ((chunk = splice(fan->in, NULL, fan->window[1], NULL, FAN_OUT_CHUNK, SPLICE_F_MOVE)) == -1 && errno == EINTR)
+		{
+		}
+		if (chunk <= 0)
+		{
+			if (chunk == -1)
+			{
+				perror("Error - could not relay the pipeline");
+			}
+			break;
+		}
+		// tee() duplicates the window without consuming it, so every consumer but the last gets
+		// a reference to the same pages
+		for (int i = 0; i < last; i++)
+		{
+			teed[i] = chunk;
+			if (fan->to_consumer[i] == -1)
+			{
+				continue;
+			}
+			await_fd(fan->to_consumer[i], POLLOUT);
+			while ((n = tee(fan->window[0], fan->to_consumer[i], chunk, 0)) == -1 && errno == EINTR)
+			{
+			}
+			if (n == -1)
+			{
+				fan_out_drop(fan, i);
+				continue;
+			}
+			teed[i] = n;
+			short_tee |= n < chunk;
+		}
+		if (short_tee)
+		{
+			// The window can only be teed from its start - send the missing tails the slow way
+			if (fan_out_copy(fan, chunk) != 0)
+			{
+				break;
+			}
+			for (int i = 0; i <= last; i++)
+			{
+				size_t from = i == last ? 0 : teed[i];
+				if (fan->to_consumer[i] != -1 && from < (size_t)chunk &&
+					write_all(fan->to_consumer[i], fan->copy + from, chunk - from) != 0)
+				{
+					fan_out_drop(fan, i);
+				}
+			}
+			continue;
+		}
+		// The last consumer takes the window's pages over
+		while (moved < (size_t)chunk)
+		{
+			await_fd(fan->to_consumer[last], POLLOUT);
+			n = splice(fan->window[0], NULL, fan->to_consumer[last], NULL, chunk - moved, SPLICE_F_MOVE);
+			if (n == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			if (n <= 0)
+			{
+				// Gone - empty the window for the next chunk
+				fan_out_drop(fan, last);
+				fan_out_copy(fan, chunk - moved);
+				break;
+			}
+			moved += n;
+		}
+	}
+	signal(SIGPIPE, sigpipe);
+	free(teed);
+}
+
+// Reads len bytes out of the window into fan->copy. Returns 0 on success, 1 (after reporting)
+// otherwise.
+int fan_out_copy(struct fan_out *fan, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	if (fan->copy == NULL && (fan->copy = malloc(FAN_OUT_CHUNK)) == NULL)
+	{
+		perror("Error - could not relay the pipeline");
+		return 1;
+	}
+	while (done < len)
+	{
+		n = read(fan->window[0], fan->copy + done, len - done);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			perror("Error - could not relay the pipeline");
+			return 1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+void fan_out_drop(struct fan_out *fan, int consumer)
+{
+	close(fan->to_consumer[consumer]);
+	fan->to_consumer[consumer] = -1;
+}
+
+// Closes every fd the fan-out still holds (the consumers see EOF) and frees it.
+void fan_out_close(struct fan_out *fan)
+{
+	for (int i = 0; fan->to_consumer != NULL && i < fan->consumers; i++)
+	{
+		if (fan->to_consumer[i] != -1)
+		{
+			close(fan->to_consumer[i]);
+		}
+	}
+	for (int i = 0; i < 2; i++)
+	{
+		if (fan->window[i] != -1)
+		{
+			close(fan->window[i]);
+		}
+	}
+	if (fan->in != -1)
+	{
+		close(fan->in);
+	}
+	free(fan->to_consumer);
+	free(fan->argv);
+	free(fan->first);
+	free(fan->copy);
+	fan->to_consumer = NULL;
+	fan->argv = NULL;
+	fan->first = NULL;
+	fan->copy = NULL;
+}
+
+// Parses a pipe size: a byte count with an optional K or M suffix, "auto" for adaptive sizing or
+// "default" for the kernel's. Sizes above the system maximum are capped to it.
+// Returns 0 on success, 1 if word is not a pipe size.
+int parse_pipe_sizing(const char *word, struct pipe_sizing *sizing)
+{
+	char *end;
+	long long size;
+
+	if (strcmp(word, "auto") == 0 || strcmp(word, "default") == 0)
+	{
+		sizing->size = 0;
+		sizing->adaptive = word[0] == 'a';
+		return 0;
+	}
+	errno = 0;
+	size = strtoll(word, &end, 10);
+	if (*end == 'K' || *end == 'k')
+	{
+		size *= 1024;
+		end++;
+	}
+	else if (*end == 'M' || *end == 'm')
+	{
+		size *= 1024 * 1024;
+		end++;
+	}
+	if (word[0] == '\0' || *end != '\0' || errno != 0 || size < 1 || size > INT_MAX)
+	{
+		return 1;
+	}
+	sizing->size = size > get_pipe_max_size() ? get_pipe_max_size() : (int)size;
+	sizing->adaptive = 0;
+	return 0;
+}
+
+const struct pipe_sizing *current_pipe_sizing(void)
+{
+	return line_options.has_pipe_sizing ? &line_options.pipe_sizing : &pipe_sizing;
+}
+
+// The largest capacity an unprivileged process may give a pipe.
+int get_pipe_max_size(void)
+{
+	FILE *file;
+
+	if (pipe_max_size == 0)
+	{
+		pipe_max_size = 1024 * 1024; // the kernel's default limit
+		if ((file = fopen(PIPE_MAX_SIZE_PATH, "re")) != NULL)
+		{
+			if (fscanf(file, "%d", &pipe_max_size) != 1 || pipe_max_size < 4096)
+			{
+				pipe_max_size = 1024 * 1024;
+			}
+			fclose(file);
+		}
+	}
+	return pipe_max_size;
+}
+
+// Gives a pipeline pipe the capacity asked for on this line or globally. A refused size (the
+// user's pipe quota is used up) leaves the pipe as it is.
+void size_pipe(int fd)
+{
+	const struct pipe_sizing *sizing = current_pipe_sizing();
+	if (sizing->size > 0)
+	{
+		fcntl(fd, F_SETPIPE_SZ, sizing->size);
+	}
+}
+
+// Creates a close-on-exec pipe sized for the current line. Returns 0, or -1 with errno set.
+int open_pipe(int pipefd[2])
+{
+	uint64_t started = trace_clock();
+
+	if (pipe2(pipefd, O_CLOEXEC) == -1)
+	{
+		return -1;
+	}
+	size_pipe(pipefd[0]);
+	trace_span("pipe", "pipe", trace.shell, started, NULL);
+	return 0;
+}
+
+// Waits for the pipeline's processes while checking every PIPE_ADAPT_INTERVAL_MS for stages
+// blocked on a full stdout pipe, growing those pipes. Reaped entries of pids are set to 0.
+// Returns 1, or 0 if waiting failed.
+int watch_pipeline(pid_t *pids, int count)
+{
+	struct pollfd *fds = malloc(sizeof(struct pollfd) * count);
+	int running = 0, ready;
+	siginfo_t info;
+
+	if (fds == NULL)
+	{
+		// pipe_it_up's plain wait takes over
+		return 1;
+	}
+	for (int k = 0; k < count; k++)
+	{
+		fds[k].fd = pids[k] > 0 ? syscall(SYS_pidfd_open, pids[k], 0) : -1;
+		fds[k].events = POLLIN;
+		running += fds[k].fd != -1;
+	}
+	while (running > 0)
+	{
+		ready = poll(fds, count, PIPE_ADAPT_INTERVAL_MS);
+		if (ready == -1 && errno != EINTR)
+		{
+			perror("failure during waitpid");
+			break;
+		}
+		if (events_wanted())
+		{
+			run_events(-1, 0);
+		}
+		if (ready == 0 && waitid(P_PGID, line_group.pgid, &info, WSTOPPED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0)
+		{
+			// Suspended - the plain wait that takes over turns the line into a job
+			break;
+		}
+		for (int k = 0; k < count; k++)
+		{
+			if (fds[k].fd == -1)
+			{
+				continue;
+			}
+			if (fds[k].revents != 0)
+			{
+				// Exited - poll skips negative fds from now on
+				wait_child(pids[k]);
+				pids[k] = 0;
+				close(fds[k].fd);
+				fds[k].fd = -1;
+				running--;
+			}
+			else if (ready == 0 && k < count - 1)
+			{
+				grow_full_pipe(pids[k]);
+			}
+		}
+	}
+	for (int k = 0; k < count; k++)
+	{
+		if (fds[k].fd != -1)
+		{
+			close(fds[k].fd);
+		}
+	}
+	free(fds);
+	return 1;
+}
+
+// Doubles the capacity of writer's stdout if it is a pipe with no room left - writer is waiting
+// for its reader, and a bigger pipe lets both run longer between context switches.
+void grow_full_pipe(pid_t writer)
+{
+	char path[64];
+	int fd, capacity, used;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd/1", (int)writer);
+	// A write-only open cannot keep the reader from seeing EOF after it is closed again
+	fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return;
+	}
+	capacity = fcntl(fd, F_GETPIPE_SZ);
+	if (capacity > 0 && capacity < get_pipe_max_size() && ioctl(fd, FIONREAD, &used) == 0 && used >= capacity)
+	{
+		if (fcntl(fd, F_SETPIPE_SZ, capacity * 2 > get_pipe_max_size() ? get_pipe_max_size() : capacity * 2) != -1)
+		{
+			pipes_grown++;
+		}
+	}
+	close(fd);
+}
+
+int prefix_pipesize(char **args)
+{
+	if (parse_pipe_sizing(args[0], &line_options.pipe_sizing) != 0)
+	{
+		fprintf(stderr, "pipesize: %s: not a pipe size\n", args[0]);
+		return 1;
+	}
+	line_options.has_pipe_sizing = 1;
+	return 0;
+}
+
+// pipesize                 - show how pipeline pipes are sized
+// pipesize size            - size them all from now on: bytes (K/M suffixes), auto or default
+// pipesize size cmd | ...  - size only this pipeline's pipes (a prefix)
+int builtin_pipesize(int count, char **arglist)
+{
+	if (count == 1)
+	{
+		if (pipe_sizing.adaptive)
+		{
+			printf("pipesize\tauto\n");
+		}
+		else if (pipe_sizing.size > 0)
+		{
+			printf("pipesize\t%d\n", pipe_sizing.size);
+		}
+		else
+		{
+			printf("pipesize\tdefault\n");
+		}
+		printf("max\t%d\n", get_pipe_max_size());
+		printf("grown\t%lu\n", pipes_grown);
+		fflush(stdout);
+		return 1;
+	}
+	if (parse_pipe_sizing(arglist[1], &pipe_sizing) != 0)
+	{
+		fprintf(stderr, "pipesize: %s: not a pipe size\n", arglist[1]);
+	}
+	return 1;
+}
+
+// Makes room for room more bytes after buffer->end, moving the pending bytes to the front first.
+// Returns 0 on success, 1 (after reporting) if the buffer could not grow.
+int buffer_reserve(struct byte_buffer *buffer, size_t room)
+{
+	size_t len = buffer->end - buffer->start;
+	size_t capacity = buffer->capacity == 0 ? room : buffer->capacity;
+	char *data;
+
+	if (buffer->start > 0 && buffer->end + room > buffer->capacity)
+	{
+		memmove(buffer->data, buffer->data + buffer->start, len);
+		buffer->start = 0;
+		buffer->end = len;
+	}
+	if (buffer->end + room <= buffer->capacity)
+	{
+		return 0;
+	}
+	while (capacity < buffer->end + room)
+	{
+		capacity *= 2;
+	}
+	data = realloc(buffer->data, capacity);
+	if (data == NULL)
+	{
+		perror("Error - could not allocate pipeline buffer");
+		return 1;
+	}
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return 0;
+}
+
+int buffer_append(struct byte_buffer *buffer, const char *data, size_t len)
+{
+	if (len == 0)
+	{
+		return 0;
+	}
+	if (buffer_reserve(buffer, len) != 0)
+	{
+		return 1;
+	}
+	memcpy(buffer->data + buffer->end, data, len);
+	buffer->end += len;
+	return 0;
+}
+
+int is_redirect(enum token_kind kind)
+{
+	return kind >= TOKEN_REDIRECT_IN && kind <= TOKEN_OUT_TO_ERR;
+}
+
+// Resolves the redirections among words (NULL terminated; kinds[i] is the kind of words[i], or
+// NULL to classify them here) into plan. base is what fds 0-2 of the command are before its
+// redirections - -1, or a pipe end the caller keeps - and heredocs has the bodies for its "<<"s.
+// Returns 0 on success, 1 (after reporting, with nothing left open) if a redirection has no file,
+// the file cannot be opened or no command is left.
+int redirect_plan_build(struct redirect_plan *plan, char **words, const unsigned char *kinds, const int base[3],
+						struct heredocs *heredocs)
+{
+	int count = 0, n;
+
+	for (n = 0; words[n] != NULL; n++)
+	{
+	}
+	if (n + 1 > plan->capacity)
+	{
+		int capacity = plan->capacity == 0 ? 16 : plan->capacity;
+		while (capacity < n + 1)
+		{
+			capacity *= 2;
+		}
+		char **argv = realloc(plan->argv, sizeof(char *) * capacity);
+		if (argv == NULL)
+		{
+			perror("Error - Could not redirect command");
+			return 1;
+		}
+		plan->argv = argv;
+		plan->capacity = capacity;
+	}
+	for (int fd = 0; fd < 3; fd++)
+	{
+		plan->fds[fd] = base[fd];
+		plan->owned[fd] = 0;
+	}
+	// Left to right, so a later redirection of the same fd wins and "> file 2>&1" sends both to file
+	for (int i = 0; i < n; i++)
+	{
+		enum token_kind kind = kinds != NULL ? kinds[i] : classify_token(words[i]);
+		const struct redirection *redirection = &redirections[kind];
+		const char *operand;
+		int file;
+
+		if (!is_redirect(kind))
+		{
+			plan->argv[count++] = words[i];
+			continue;
+		}
+		if (redirection->from != -1)
+		{
+			// The other fd as the command would have it - its redirection so far, or the shell's own
+			file = plan->fds[redirection->from] != -1 ? plan->fds[redirection->from] : redirection->from;
+			redirect_plan_set(plan, redirection->fd, file, plan->owned[redirection->from]);
+			continue;
+		}
+		if (redirection->attached > 0 && words[i][redirection->attached] != '\0')
+		{
+			operand = words[i] + redirection->attached;
+		}
+		else if (i + 1 == n || (kinds != NULL ? kinds[i + 1] : classify_token(words[i + 1])) != TOKEN_WORD)
+		{
+			fprintf(stderr, "Error - redirection needs a command and a file\n");
+			redirect_plan_close(plan);
+			return 1;
+		}
+		else
+		{
+			operand = words[++i];
+		}
+		if (kind == TOKEN_HEREDOC)
+		{
+			// shell.c already matched the delimiter (the operand) and took the body out of the input
+			struct heredoc body = heredocs->next < heredocs->count ? heredocs->bodies[heredocs->next++] : (struct heredoc){"", 0};
+			file = open_here_text(body.text, body.len, 0);
+		}
+		else if (kind == TOKEN_HERESTRING)
+		{
+			file = open_here_text(operand, strlen(operand), 1);
+		}
+		else
+		{
+			file = open(operand, redirection->flags | O_CLOEXEC, 0777);
+		}
+		if (file == -1)
+		{
+			perror(redirection->fd == STDIN_FILENO ? "Error - Could not open the file descriptor - input"
+												   : "Error - Could not open the file descriptor - output");
+			redirect_plan_close(plan);
+			return 1;
+		}
+		redirect_plan_set(plan, redirection->fd, file, 1);
+	}
+	if (count == 0)
+	{
+		fprintf(stderr, "Error - redirection needs a command and a file\n");
+		redirect_plan_close(plan);
+		return 1;
+	}
+	plan->argv[count] = NULL;
+	return 0;
+}
+
+// Points fd of the command at target (owned - opened for the plan). What fd pointed at before is
+// closed unless another fd still uses it.
+void redirect_plan_set(struct redirect_plan *plan, int fd, int target, int owned)
+{
+	int shared = 0;
+
+	for (int other = 0; other < 3; other++)
+	{
+		if (other != fd && plan->fds[other] == fd && !plan->owned[other])
+		{
+			// "2>&1 > file" - fd 2 still has to get the shell's stdout, which the child's fd 1 is
+			// about to stop being, so it gets a copy of it
+			plan->fds[other] = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+			plan->owned[other] = plan->fds[other] != -1;
+		}
+		shared |= other != fd && plan->fds[other] == plan->fds[fd];
+	}
+	if (plan->owned[fd] && !shared)
+	{
+		close(plan->fds[fd]);
+	}
+	plan->fds[fd] = target;
+	plan->owned[fd] = owned;
+}
+
+// Closes the files plan opened; the command they were opened for has them by now.
+void redirect_plan_close(struct redirect_plan *plan)
+{
+	for (int fd = 0; fd < 3; fd++)
+	{
+		int closed = 0;
+		for (int earlier = 0; earlier < fd; earlier++)
+		{
+			closed |= plan->owned[earlier] && plan->fds[earlier] == plan->fds[fd];
+		}
+		if (plan->owned[fd] && !closed)
+		{
+			close(plan->fds[fd]);
+		}
+	}
+	for (int fd = 0; fd < 3; fd++)
+	{
+		plan->owned[fd] = 0;
+	}
+}
+
+// Called by shell.c with the here-document bodies of the line it is about to run.
+void add_heredoc(int index, const char *body, size_t len)
+{
+	if (index == 0)
+	{
+		// The previous line's are gone with its input
+		line_heredocs.count = 0;
+		line_heredocs.next = 0;
+	}
+	if (line_heredocs.count == line_heredocs.capacity)
+	{
+		int capacity = line_heredocs.capacity == 0 ? 4 : line_heredocs.capacity * 2;
+		struct heredoc *bodies = realloc(line_heredocs.bodies, sizeof(struct heredoc) * capacity);
+		if (bodies == NULL)
+		{
+			// Its "<<" reads an empty body instead
+			return;
+		}
+		line_heredocs.bodies = bodies;
+		line_heredocs.capacity = capacity;
+	}
+	line_heredocs.bodies[line_heredocs.count++] = (struct heredoc){body, len};
+}
+
+// Copies from's bodies into to - the array followed by the texts, in one allocation freed with
+// to->bodies. Returns 0 on success, 1 if it could not be allocated.
+int heredocs_copy(struct heredocs *to, const struct heredocs *from)
+{
+	size_t len = 0;
+	char *text;
+
+	*to = (struct heredocs){0};
+	if (from->count == 0)
+	{
+		return 0;
+	}
+	for (int i = 0; i < from->count; i++)
+	{
+		len += from->bodies[i].len;
+	}
+	to->bodies = malloc(sizeof(struct heredoc) * from->count + len);
+	if (to->bodies == NULL)
+	{
+		return 1;
+	}
+	text = (char *)(to->bodies + from->count);
+	for (int i = 0; i < from->count; i++)
+	{
+		memcpy(text, from->bodies[i].text, from->bodies[i].len);
+		to->bodies[i] = (struct heredoc){text, from->bodies[i].len};
+		text += from->bodies[i].len;
+	}
+	to->count = to->capacity = from->count;
+	return 0;
+}
+
+// Returns an fd that reads text[0..len), and a newline after it if newline is set, or -1 on
+// failure. It is a memfd, so nothing touches the disk and no process has to write it.
+int open_here_text(const char *text, size_t len, int newline)
+{
+	struct iovec parts[2] = {{(void *)text, len}, {"\n", newline ? 1 : 0}};
+	int fd = memfd_create("heredoc", MFD_CLOEXEC);
+	ssize_t n;
+
+	if (fd == -1)
+	{
+		return -1;
+	}
+	// Written at offset 0 without moving the file offset, so the command reads it from the start
+	n = pwritev(fd, parts, 2, 0);
+	if (n != (ssize_t)(parts[0].iov_len + parts[1].iov_len))
+	{
+		int err = n == -1 ? errno : ENOSPC;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+int execute_general(struct parsed_command *cmd)
+{
+	// Executes command (with its redirections) and starts another one only after it is completed.
+	struct spawn_request req;
+	const struct builtin *builtin;
+	pid_t pid;
+	int ret;
+
+	init_spawn_request(&req, cmd->argv, 1, "Error - Could not execute child process");
+	if (cmd->redirects > 0)
+	{
+		if (redirect_plan_build(&redirect_plan, cmd->argv, cmd->kinds, req.fds, &line_heredocs) != 0)
+		{
+			return 1;
+		}
+		req.argv = redirect_plan.argv;
+		memcpy(req.fds, redirect_plan.fds, sizeof(req.fds));
+	}
+	if ((builtin = find_builtin(req.argv[0])) != NULL)
+	{
+		// Builtins run in the shell, with its own fds pointed at the files for the duration
+		ret = run_builtin(builtin, req.argv, req.fds);
+		redirect_plan_close(&redirect_plan);
+		return ret;
+	}
+	pid = spawn_admitted(&req);
+	redirect_plan_close(&redirect_plan);
+	if (pid == -1)
+	{
+		perror("Failed during forking");
+		return 1;
+	}
+	if (pid > 0 && wait_child(pid) == -1 && errno != ECHILD)
+	{
+		raise_error("Error - failed waiting for children ");
+	}
+
+	return 1;
+}
+
+void init_spawn_request(struct spawn_request *req, char **argv, int foreground, const char *error)
+{
+	req->argv = argv;
+	req->fds[STDIN_FILENO] = -1;
+	req->fds[STDOUT_FILENO] = -1;
+	req->fds[STDERR_FILENO] = -1;
+	req->foreground = foreground;
+	req->error = error;
+	req->pgroup = line_group.pgid;
+	req->terminal = foreground && line_group.pgid == 0 && terminal.fd != -1;
+	// The line's commands get the pipes of its "<(...)" and ">(...)"
+	req->inherit = line_expansion != NULL ? line_expansion->fds : NULL;
+	req->inherit_count = line_expansion != NULL ? line_expansion->substitutions : 0;
+}
+
+// Starts req->argv in a child process with the configured backend.
+// Returns the child's pid, 0 if the command could not be executed (already reported, nothing
+// to wait for), or -1 with errno set if no process could be created at all.
+pid_t spawn_process(const struct spawn_request *req)
+{
+	uint64_t started = trace_clock();
+	const char *path = resolve_command(req->argv[0]);
+	pid_t pid;
+
+	if (path == NULL)
+	{
+		errno = ENOENT;
+		perror(req->error);
+		return 0;
+	}
+	spawn_pressure.spawns++;
+	pid = spawn_backend == SPAWN_BACKEND_FORK ? spawn_fork(req, path) : spawn_posix(req, path);
+	if (pid == -1 && spawn_is_exhausted(errno))
+	{
+		spawn_pressure.exhausted++;
+	}
+	if (pid == 0 && errno == ENOENT && strchr(req->argv[0], '/') == NULL)
+	{
+		// The cached binary is gone - look it up again once before giving up.
+		path_cache_forget(req->argv[0]);
+		if ((path = resolve_command(req->argv[0])) != NULL)
+		{
+			pid = spawn_backend == SPAWN_BACKEND_FORK ? spawn_fork(req, path) : spawn_posix(req, path);
+		}
+	}
+	if (pid == 0)
+	{
+		perror(req->error);
+	}
+	if (pid > 0 && line_group.pgid == 0)
+	{
+		line_group.pgid = pid;
+		line_group.foreground = req->foreground;
+		line_group.has_terminal = req->terminal;
+	}
+	if (pid > 0 && spawn_timeout != NULL)
+	{
+		timeout_track(spawn_timeout, pid);
+	}
+	if (pid > 0)
+	{
+		stats_log_spawned(pid, req->argv[0]);
+	}
+	if (pid > 0 && trace.out != NULL)
+	{
+		// Both backends return once the child has exec'd, so this covers fork and exec
+		trace_span("spawn", spawn_backend == SPAWN_BACKEND_FORK ? "fork" : "posix_spawn", pid, started, path);
+		trace_process_start(pid, req->argv);
+	}
+	return pid;
+}
+
+// Starts req like spawn_process, but when the system is out of processes or memory the spawn
+// is retried with exponential backoff instead of failing the command at once. Returns what
+// spawn_process returns; -1 only after SPAWN_RETRIES retries failed too.
+pid_t spawn_admitted(const struct spawn_request *req)
+{
+	int delay_ms = SPAWN_BACKOFF_INITIAL_MS;
+	pid_t pid;
+
+	for (int retry = 0; (pid = spawn_process(req)) == -1 && spawn_is_exhausted(errno); retry++)
+	{
+		if (retry == SPAWN_RETRIES)
+		{
+			spawn_pressure.refused++;
+			break;
+		}
+		spawn_pressure.retries++;
+		spawn_backoff(delay_ms);
+		delay_ms = delay_ms * 2 > SPAWN_BACKOFF_MAX_MS ? SPAWN_BACKOFF_MAX_MS : delay_ms * 2;
+	}
+	return pid;
+}
+
+// EAGAIN (RLIMIT_NPROC or the kernel's pid limit) and ENOMEM pass once other processes exit.
+int spawn_is_exhausted(int err)
+{
+	return err == EAGAIN || err == ENOMEM;
+}
+
+// Sleeps for delay_ms, waking up early when one of our background jobs exits and frees a process.
+void spawn_backoff(int delay_ms)
+{
+	struct timespec pause = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+	int err = errno;
+
+	spawn_pressure.backoff_ms += delay_ms;
+	if (jobs.running > 0)
+	{
+		reap_jobs(delay_ms);
+	}
+	else
+	{
+		nanosleep(&pause, NULL);
+	}
+	errno = err;
+}
+
+// spawnstat - how often the shell ran out of processes or memory and how it coped
+int builtin_spawnstat(int count, char **arglist)
+{
+	struct rlimit nproc;
+
+	(void)count;
+	(void)arglist;
+	printf("spawns\t%lu\n", spawn_pressure.spawns);
+	printf("exhausted\t%lu\n", spawn_pressure.exhausted);
+	printf("retries\t%lu\n", spawn_pressure.retries);
+	printf("backoff_ms\t%lu\n", spawn_pressure.backoff_ms);
+	printf("refused\t%lu\n", spawn_pressure.refused);
+	printf("queued\t%lu\n", spawn_pressure.queued);
+	printf("queue_length\t%d\n", jobs.queued);
+	printf("queue_peak\t%d\n", spawn_pressure.peak_queued);
+	printf("running_jobs\t%d\n", jobs.running);
+	if (getrlimit(RLIMIT_NPROC, &nproc) == 0 && nproc.rlim_cur != RLIM_INFINITY)
+	{
+		printf("process_limit\t%llu\n", (unsigned long long)nproc.rlim_cur);
+	}
+	else
+	{
+		printf("process_limit\tunlimited\n");
+	}
+	fflush(stdout);
+	return 1;
+}
+
+pid_t spawn_posix(const struct spawn_request *req, const char *path)
+{
+	// Signal defaults and fd redirections are applied by posix_spawn itself, so the child never
+	// runs any of our code and the shell's memory is never copied.
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t defaults, mask;
+	pid_t pid;
+	int err;
+
+	if ((err = posix_spawn_file_actions_init(&actions)) != 0)
+	{
+		errno = err;
+		return -1;
+	}
+	for (int fd = 0; fd < 3; fd++)
+	{
+		if (req->fds[fd] != -1 && (err = posix_spawn_file_actions_adddup2(&actions, req->fds[fd], fd)) != 0)
+		{
+			posix_spawn_file_actions_destroy(&actions);
+			errno = err;
+			return -1;
+		}
+	}
+	for (int i = 0; i < req->inherit_count; i++)
+	{
+		// A dup2 onto itself clears close-on-exec
+		if (req->inherit[i] != -1 && (err = posix_spawn_file_actions_adddup2(&actions, req->inherit[i], req->inherit[i])) != 0)
+		{
+			posix_spawn_file_actions_destroy(&actions);
+			errno = err;
+			return -1;
+		}
+	}
+	if ((err = posix_spawnattr_init(&attr)) != 0)
+	{
+		posix_spawn_file_actions_destroy(&actions);
+		errno = err;
+		return -1;
+	}
+	if (req->terminal)
+	{
+		// The child makes its group the terminal's foreground before it execs, so it can never
+		// read the terminal while still in the background
+#ifdef POSIX_SPAWN_TCSETPGROUP_AVAILABLE
+		posix_spawn_file_actions_addtcsetpgrp_np(&actions, terminal.fd);
+#endif
+	}
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGCHLD);
+	sigaddset(&defaults, SIGTSTP);
+	sigaddset(&defaults, SIGTTIN);
+	sigaddset(&defaults, SIGTTOU);
+	// Background jobs are in groups of their own, out of reach of the terminal's Ctrl-C, so they
+	// get SIGINT back too - fg can make them foreground
+	sigaddset(&defaults, SIGINT);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	// The shell blocks the signals its event loop reads; the command gets them unblocked
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setpgroup(&attr, req->pgroup);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+	err = posix_spawn(&pid, path, &actions, &attr, req->argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (err == EAGAIN || err == ENOMEM)
+	{
+		// No child was created - same situation as a failed fork()
+		errno = err;
+		return -1;
+	}
+	if (err != 0)
+	{
+		// The child was created but exec failed; glibc already reaped it.
+		errno = err;
+		return 0;
+	}
+#ifndef POSIX_SPAWN_TCSETPGROUP_AVAILABLE
+	if (req->terminal)
+	{
+		tcsetpgrp(terminal.fd, pid);
+	}
+#endif
+	return pid;
+}
+
+pid_t spawn_fork(const struct spawn_request *req, const char *path)
+{
+	// The child reports a failed exec as its errno through a close-on-exec pipe: a successful exec
+	// closes the pipe with nothing written, so one read tells the parent how the exec went.
+	int status_pipe[2], err;
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe2(status_pipe, O_CLOEXEC) == -1)
+	{
+		return -1;
+	}
+	pid = fork();
+	if (pid == -1)
+	{
+		err = errno;
+		close(status_pipe[0]);
+		close(status_pipe[1]);
+		errno = err;
+		return -1;
+	}
+	if (pid == 0)
+	{
+		// Child process
+		close(status_pipe[0]);
+		sigset_t mask;
+		sigemptyset(&mask);
+		// The group first: the terminal can only be handed to it once it exists, and SIGTTOU is
+		// still ignored here
+		if (setpgid(0, req->pgroup) == -1 || (req->terminal && tcsetpgrp(terminal.fd, getpgrp()) == -1))
+		{
+			report_child_error(status_pipe[1]);
+		}
+		if (handle_signal(SIGCHLD, SIG_DFL) + handle_signal(SIGTSTP, SIG_DFL) + handle_signal(SIGTTIN, SIG_DFL) +
+					handle_signal(SIGTTOU, SIG_DFL) + handle_signal(SIGINT, SIG_DFL) >
+				0 ||
+			sigprocmask(SIG_SETMASK, &mask, NULL) == -1)
+		{
+			report_child_error(status_pipe[1]);
+		}
+		for (int fd = 0; fd < 3; fd++)
+		{
+			if (req->fds[fd] != -1 && dup2(req->fds[fd], fd) == -1)
+			{
+				report_child_error(status_pipe[1]);
+			}
+		}
+		for (int i = 0; i < req->inherit_count; i++)
+		{
+			if (req->inherit[i] != -1 && fcntl(req->inherit[i], F_SETFD, 0) == -1)
+			{
+				report_child_error(status_pipe[1]);
+			}
+		}
+		execv(path, req->argv);
+		report_child_error(status_pipe[1]);
+	}
+	// Parent - sets the group too, so it exists whichever of the two runs first
+	setpgid(pid, req->pgroup == 0 ? pid : req->pgroup);
+	close(status_pipe[1]);
+	while ((n = read(status_pipe[0], &err, sizeof(err))) == -1 && errno == EINTR)
+	{
+	}
+	close(status_pipe[0]);
+	if (n != sizeof(err))
+	{
+		// EOF - the pipe was closed by the exec
+		return pid;
+	}
+	// The child never ran the command; reap it now so it is not left for a later wait
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+	{
+	}
+	errno = err;
+	return 0;
+}
+
+// Returns the file to exec for name: name itself when it contains a '/', otherwise its cached
+// PATH lookup (resolving and caching it on a miss). NULL if it is not found in PATH.
+const char *resolve_command(const char *name)
+{
+	const char *path_env = getenv("PATH");
+	struct path_entry *entry;
+	char *path;
+
+	if (strchr(name, '/') != NULL)
+	{
+		return name;
+	}
+	if (path_env == NULL)
+	{
+		path_env = DEFAULT_PATH;
+	}
+	if (path_cache.path_env == NULL || strcmp(path_cache.path_env, path_env) != 0)
+	{
+		// PATH changed since the entries were resolved
+		path_cache_clear();
+		if ((path_cache.path_env = strdup(path_env)) == NULL)
+		{
+			return NULL;
+		}
+	}
+	if (path_cache.used * 2 >= path_cache.capacity && path_cache_grow() != 0)
+	{
+		// Out of memory - report the command as missing
+		return NULL;
+	}
+	entry = path_cache_slot(name);
+	if (entry->name == NULL)
+	{
+		if ((path = search_path(name, path_env)) == NULL)
+		{
+			return NULL;
+		}
+		if ((entry->name = strdup(name)) == NULL)
+		{
+			free(path);
+			return NULL;
+		}
+		entry->path = path;
+		entry->hits = 0;
+		path_cache.used++;
+	}
+	entry->hits++;
+	return entry->path;
+}
+
+// Walks path_env like execvp does and returns a malloc'd path to the first executable regular
+// file called name, or NULL.
+char *search_path(const char *name, const char *path_env)
+{
+	size_t name_len = strlen(name);
+	const char *dir = path_env;
+	struct stat st;
+
+	while (1)
+	{
+		const char *end = strchrnul(dir, ':');
+		size_t dir_len = end - dir;
+		char *candidate = malloc(dir_len + name_len + 3);
+		if (candidate == NULL)
+		{
+			return NULL;
+		}
+		if (dir_len == 0)
+		{
+			// An empty PATH element means the current directory
+			candidate[0] = '.';
+			dir_len = 1;
+		}
+		else
+		{
+			memcpy(candidate, dir, dir_len);
+		}
+		candidate[dir_len] = '/';
+		memcpy(candidate + dir_len + 1, name, name_len + 1);
+		if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+		{
+			return candidate;
+		}
+		free(candidate);
+		if (*end == '\0')
+		{
+			return NULL;
+		}
+		dir = end + 1;
+	}
+}
+
+// Returns the slot holding name, or the empty slot where it would be inserted.
+struct path_entry *path_cache_slot(const char *name)
+{
+	// FNV-1a
+	size_t hash = 2166136261u;
+	for (const char *c = name; *c != '\0'; c++)
+	{
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	}
+	for (size_t i = hash & (path_cache.capacity - 1);; i = (i + 1) & (path_cache.capacity - 1))
+	{
+		struct path_entry *entry = &path_cache.slots[i];
+		if (entry->name == NULL || strcmp(entry->name, name) == 0)
+		{
+			return entry;
+		}
+	}
+}
+
+void path_cache_forget(const char *name)
+{
+	// Removing from a linear probing table would need tombstones; a rebuild without the entry
+	// is simpler and this only happens when a binary disappears.
+	struct path_entry *old = path_cache.slots;
+	size_t capacity = path_cache.capacity;
+
+	if (old == NULL)
+	{
+		return;
+	}
+	path_cache.slots = calloc(capacity, sizeof(struct path_entry));
+	if (path_cache.slots == NULL)
+	{
+		path_cache.slots = old;
+		path_cache_clear();
+		return;
+	}
+	path_cache.used = 0;
+	for (size_t i = 0; i < capacity; i++)
+	{
+		if (old[i].name == NULL)
+		{
+			continue;
+		}
+		if (strcmp(old[i].name, name) == 0)
+		{
+			free(old[i].name);
+			free(old[i].path);
+			continue;
+		}
+		*path_cache_slot(old[i].name) = old[i];
+		path_cache.used++;
+	}
+	free(old);
+}
+
+void path_cache_clear(void)
+{
+	for (size_t i = 0; i < path_cache.capacity; i++)
+	{
+		free(path_cache.slots[i].name);
+		free(path_cache.slots[i].path);
+	}
+	free(path_cache.slots);
+	free(path_cache.path_env);
+	path_cache.slots = NULL;
+	path_cache.capacity = 0;
+	path_cache.used = 0;
+	path_cache.path_env = NULL;
+}
+
+// Doubles the table (or allocates the first one). Returns 0 on success, 1 on failure.
+int path_cache_grow(void)
+{
+	struct path_entry *old = path_cache.slots;
+	size_t old_capacity = path_cache.capacity;
+	size_t capacity = old_capacity == 0 ? PATH_CACHE_INITIAL_CAPACITY : old_capacity * 2;
+	struct path_entry *slots = calloc(capacity, sizeof(struct path_entry));
+
+	if (slots == NULL)
+	{
+		return 1;
+	}
+	path_cache.slots = slots;
+	path_cache.capacity = capacity;
+	for (size_t i = 0; i < old_capacity; i++)
+	{
+		if (old[i].name != NULL)
+		{
+			*path_cache_slot(old[i].name) = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+// hash          - list the cached commands and how often each was used
+// hash -r       - forget every cached location
+// hash name ... - resolve and cache the given names
+int builtin_hash(int count, char **arglist)
+{
+	if (count == 1)
+	{
+		if (path_cache.used == 0)
+		{
+			printf("hash: hash table empty\n");
+			fflush(stdout);
+			return 1;
+		}
+		printf("hits\tcommand\n");
+		for (size_t i = 0; i < path_cache.capacity; i++)
+		{
+			if (path_cache.slots[i].name != NULL)
+			{
+				printf("%4lu\t%s\n", path_cache.slots[i].hits, path_cache.slots[i].path);
+			}
+		}
+		fflush(stdout);
+		return 1;
+	}
+	for (int i = 1; i < count; i++)
+	{
+		if (strcmp(arglist[i], "-r") == 0)
+		{
+			path_cache_clear();
+		}
+		else if (resolve_command(arglist[i]) == NULL)
+		{
+			fprintf(stderr, "hash: %s: not found\n", arglist[i]);
+		}
+		else if (strchr(arglist[i], '/') == NULL)
+		{
+			// Looking a name up is not a use of it
+			path_cache_slot(arglist[i])->hits--;
+		}
+	}
+	return 1;
+}
+
+// Records a background process in the job table and starts watching it through a pidfd.
+// Returns the job, or NULL if it could not be recorded (the process is then only reaped).
+struct job *job_add(pid_t pid, char **argv)
+{
+	struct job *job = job_create(argv);
+	if (job == NULL)
+	{
+		job_untracked(pid);
+		return NULL;
+	}
+	job_start(job, pid);
+	return job;
+}
+
+// Remembers a background process that could not be recorded as a job, so reap_jobs still reaps it.
+// If even that fails it stays a zombie until the shell exits.
+void job_untracked(pid_t pid)
+{
+	if (jobs.untracked_count == jobs.untracked_capacity)
+	{
+		int capacity = jobs.untracked_capacity == 0 ? 8 : jobs.untracked_capacity * 2;
+		pid_t *untracked = realloc(jobs.untracked, sizeof(pid_t) * capacity);
+		if (untracked == NULL)
+		{
+			return;
+		}
+		jobs.untracked = untracked;
+		jobs.untracked_capacity = capacity;
+	}
+	jobs.untracked[jobs.untracked_count++] = pid;
+	jobs.unwatched++;
+}
+
+// Adds pid to job's processes, watching it through a pidfd. Returns 0 on success, 1 if it could
+// not be recorded.
+int job_add_process(struct job *job, pid_t pid)
+{
+	struct job_process *process;
+	struct epoll_event event;
+
+	if ((jobs.pid_used + jobs.queued + 1) * 2 >= jobs.pid_capacity && job_table_grow() != 0)
+	{
+		return 1;
+	}
+	process = malloc(sizeof(struct job_process));
+	if (process == NULL)
+	{
+		return 1;
+	}
+	process->pid = pid;
+	process->job = job;
+	process->next = job->processes;
+	job->processes = process;
+	job->last_pid = pid;
+	*job_pid_slot(pid) = process;
+	jobs.pid_used++;
+
+	process->pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (process->pidfd != -1)
+	{
+		event.events = EPOLLIN;
+		event.data.ptr = process;
+		if (epoll_ctl(jobs.epoll_fd, EPOLL_CTL_ADD, process->pidfd, &event) == -1)
+		{
+			close(process->pidfd);
+			process->pidfd = -1;
+		}
+	}
+	if (process->pidfd == -1)
+	{
+		// Out of fds (or no pidfd support) - reap_jobs falls back to wait4 for this one
+		jobs.unwatched++;
+	}
+	return 0;
+}
+
+// Turns the foreground line, whose processes were just stopped, into a suspended job that
+// fg or bg continue. Returns it (also as line_group.job), or NULL if it could not be recorded.
+struct job *job_suspend_line(void)
+{
+	char *argv[] = {line_record.command, NULL};
+	struct job *job = job_create(argv);
+
+	if (job == NULL)
+	{
+		perror("Error - Could not record the suspended job");
+		return NULL;
+	}
+	job->pgid = line_group.pgid;
+	job->state = JOB_STOPPED;
+	job->started = line_record.started;
+	jobs.running++;
+	jobs.stopped++;
+	line_group.job = job;
+	printf("\n[%d]+  Stopped\t%s\n", job->id, job->command);
+	fflush(stdout);
+	return job;
+}
+
+// Gives a new job an id for the command line argv, with room reserved for its pid.
+// Returns NULL if it could not be allocated.
+struct job *job_create(char **argv)
+{
+	struct job *job = calloc(1, sizeof(struct job));
+	size_t len = 0;
+
+	if (job == NULL)
+	{
+		return NULL;
+	}
+	for (int i = 0; argv[i] != NULL; i++)
+	{
+		len += strlen(argv[i]) + 1;
+	}
+	job->command = malloc(len + 1);
+	if (job->command == NULL)
+	{
+		free(job);
+		return NULL;
+	}
+	job->command[0] = '\0';
+	for (int i = 0; argv[i] != NULL; i++)
+	{
+		if (i > 0)
+		{
+			strcat(job->command, " ");
+		}
+		strcat(job->command, argv[i]);
+	}
+
+	if (jobs.highest_id == jobs.id_capacity || (jobs.pid_used + jobs.queued) * 2 >= jobs.pid_capacity)
+	{
+		if (job_table_grow() != 0)
+		{
+			free(job->command);
+			free(job);
+			return NULL;
+		}
+	}
+	job->id = ++jobs.highest_id;
+	jobs.by_id[job->id - 1] = job;
+	return job;
+}
+
+// Marks a created or queued job as running as pid.
+void job_start(struct job *job, pid_t pid)
+{
+	job->pgid = pid; // a background job is a single process, which leads its line's group
+	job->state = JOB_RUNNING;
+	clock_gettime(CLOCK_MONOTONIC, &job->started);
+	jobs.running++;
+	if (job_add_process(job, pid) != 0)
+	{
+		// job_create reserved room for one pid, so this is out of memory - it is only reaped, and
+		// never counts as running since nothing would mark it done
+		jobs.running--;
+		job_untracked(pid);
+	}
+}
+
+// Records argv as a background job to be started by start_queued_jobs. Returns NULL if it could
+// not be recorded.
+struct job *job_queue(char **argv)
+{
+	struct job *job = job_create(argv);
+	size_t len = 0;
+	int words;
+	char *copy;
+
+	if (job == NULL)
+	{
+		return NULL;
+	}
+	// argv points into the shell's line buffer, so the job keeps its own copy: the pointers
+	// followed by the words, in one allocation
+	for (words = 0; argv[words] != NULL; words++)
+	{
+		len += strlen(argv[words]) + 1;
+	}
+	job->argv = malloc(sizeof(char *) * (words + 1) + len);
+	if (job->argv == NULL)
+	{
+		job_remove(job);
+		return NULL;
+	}
+	copy = (char *)(job->argv + words + 1);
+	for (int i = 0; i < words; i++)
+	{
+		job->argv[i] = copy;
+		copy = stpcpy(copy, argv[i]) + 1;
+	}
+	job->argv[words] = NULL;
+	// Its here-documents are gone from the input by the time it starts
+	if (heredocs_copy(&job->heredocs, &line_heredocs) != 0)
+	{
+		job_remove(job);
+		return NULL;
+	}
+	job->state = JOB_QUEUED;
+	job->priority = jobs.queue_priority;
+	job->timeout = spawn_timeout;
+	if (job->timeout != NULL)
+	{
+		job->timeout->users++;
+	}
+	job_enqueue(job);
+	spawn_pressure.queued++;
+	if (jobs.queued > spawn_pressure.peak_queued)
+	{
+		spawn_pressure.peak_queued = jobs.queued;
+	}
+	return job;
+}
+
+// Starts queued jobs in queue order, until the queue is empty, every slot is taken or the system
+// runs out of processes again.
+void start_queued_jobs(void)
+{
+	struct spawn_request req;
+	struct job *job;
+	pid_t pid;
+
+	while ((job = jobs.queue_head) != NULL && !job_slots_full())
+	{
+		struct timeout *line = spawn_timeout;
+		struct line_group group = line_group;
+		// It runs in a group of its own under its own line's deadline, whatever line is running now
+		line_group = (struct line_group){0};
+		spawn_timeout = job->timeout;
+		init_spawn_request(&req, job->argv, 0, "Error - Could not execute child process");
+		req.inherit_count = 0;
+		// Every attempt to start it reads its here-documents from the start
+		job->heredocs.next = 0;
+		if (redirect_plan_build(&queued_job_plan, job->argv, NULL, req.fds, &job->heredocs) != 0)
+		{
+			spawn_timeout = line;
+			line_group = group;
+			job_drop_queued(job, W_EXITCODE(1, 0));
+			continue;
+		}
+		req.argv = queued_job_plan.argv;
+		memcpy(req.fds, queued_job_plan.fds, sizeof(req.fds));
+		pid = spawn_process(&req);
+		redirect_plan_close(&queued_job_plan);
+		spawn_timeout = line;
+		line_group = group;
+		if (pid == -1 && spawn_is_exhausted(errno))
+		{
+			return;
+		}
+		if (pid == -1)
+		{
+			perror("Failed during forking");
+		}
+		job_dequeue();
+		if (pid > 0)
+		{
+			job_start(job, pid);
+			jobs.queue_stalls = 0;
+		}
+	}
+}
+
+// Inserts job into the queue behind every job of the same or a higher priority.
+void job_enqueue(struct job *job)
+{
+	struct job **link = &jobs.queue_head;
+
+	if (jobs.queue_tail != NULL && jobs.queue_tail->priority >= job->priority)
+	{
+		// The common case - every job has the same priority
+		link = &jobs.queue_tail->next_queued;
+	}
+	while (*link != NULL && (*link)->priority >= job->priority)
+	{
+		link = &(*link)->next_queued;
+	}
+	job->next_queued = *link;
+	*link = job;
+	if (job->next_queued == NULL)
+	{
+		jobs.queue_tail = job;
+	}
+	jobs.queued++;
+}
+
+// Takes the first job off the queue and marks it done as a command that could not be executed,
+// until job_start says otherwise.
+struct job *job_dequeue(void)
+{
+	struct job *job = jobs.queue_head;
+
+	job_drop_queued(job, W_EXITCODE(127, 0));
+	return job;
+}
+
+// Takes a queued job out of the queue for good, done with status without having run.
+void job_drop_queued(struct job *job, int status)
+{
+	job_unqueue(job);
+	free(job->argv);
+	job->argv = NULL;
+	free(job->heredocs.bodies);
+	job->heredocs = (struct heredocs){0};
+	if (job->timeout != NULL)
+	{
+		timeout_release(job->timeout);
+		job->timeout = NULL;
+	}
+	job->state = JOB_DONE;
+	job->status = status;
+}
+
+// Takes a queued job out of the queue, leaving it queued (to be enqueued again).
+void job_unqueue(struct job *job)
+{
+	struct job **link = &jobs.queue_head, *prev = NULL;
+
+	while (*link != job)
+	{
+		prev = *link;
+		link = &(*link)->next_queued;
+	}
+	*link = job->next_queued;
+	if (jobs.queue_tail == job)
+	{
+		jobs.queue_tail = prev;
+	}
+	job->next_queued = NULL;
+	jobs.queued--;
+}
+
+int job_slots_full(void)
+{
+	// Suspended jobs leave their slot to others
+	return jobs.slots > 0 && jobs.running - jobs.stopped >= jobs.slots;
+}
+
+// sched                 - show the slots and the queue
+// sched slots n         - let n background jobs run at once (0 - no limit)
+// sched prio n          - queue the following background jobs with priority n
+// sched prio id n       - move a queued job ("n" or "%n") to priority n
+int builtin_sched(int count, char **arglist)
+{
+	char *end;
+	long value;
+
+	if (count == 1)
+	{
+		printf("slots\t%d\n", jobs.slots);
+		printf("running\t%d\n", jobs.running);
+		printf("queued\t%d\n", jobs.queued);
+		printf("priority\t%d\n", jobs.queue_priority);
+		for (struct job *job = jobs.queue_head; job != NULL; job = job->next_queued)
+		{
+			printf("[%d]  %d\t%s\n", job->id, job->priority, job->command);
+		}
+		fflush(stdout);
+		return 1;
+	}
+	errno = 0;
+	value = strtol(arglist[count - 1], &end, 10);
+	if (arglist[count - 1][0] == '\0' || *end != '\0' || errno != 0 || value < INT_MIN || value > INT_MAX)
+	{
+		fprintf(stderr, "sched: %s: not a number\n", arglist[count - 1]);
+		return 1;
+	}
+	if (count == 3 && strcmp(arglist[1], "slots") == 0 && value >= 0)
+	{
+		jobs.slots = (int)value;
+		// More slots take effect at once
+		start_queued_jobs();
+	}
+	else if (count == 3 && strcmp(arglist[1], "prio") == 0)
+	{
+		jobs.queue_priority = (int)value;
+	}
+	else if (count == 4 && strcmp(arglist[1], "prio") == 0)
+	{
+		struct job *job = job_by_id(parse_job_id(arglist[2]));
+		if (job == NULL || job->state != JOB_QUEUED)
+		{
+			fprintf(stderr, "sched: %s: no such queued job\n", arglist[2]);
+			return 1;
+		}
+		job_unqueue(job);
+		job->priority = (int)value;
+		job_enqueue(job);
+	}
+	else
+	{
+		fprintf(stderr, "usage: sched [slots n | prio [id] n]\n");
+	}
+	return 1;
+}
+
+// Grows both indexes of the job table so one more job fits. Returns 0 on success, 1 on failure.
+int job_table_grow(void)
+{
+	if (jobs.highest_id == jobs.id_capacity)
+	{
+		int capacity = jobs.id_capacity == 0 ? JOB_TABLE_INITIAL_CAPACITY : jobs.id_capacity * 2;
+		struct job **by_id = realloc(jobs.by_id, sizeof(struct job *) * capacity);
+		if (by_id == NULL)
+		{
+			return 1;
+		}
+		memset(by_id + jobs.id_capacity, 0, sizeof(struct job *) * (capacity - jobs.id_capacity));
+		jobs.by_id = by_id;
+		jobs.id_capacity = capacity;
+	}
+	if ((jobs.pid_used + jobs.queued) * 2 >= jobs.pid_capacity)
+	{
+		struct job_process **old = jobs.by_pid;
+		size_t old_capacity = jobs.pid_capacity;
+		size_t capacity = old_capacity == 0 ? JOB_TABLE_INITIAL_CAPACITY : old_capacity * 2;
+		struct job_process **by_pid = calloc(capacity, sizeof(struct job_process *));
+		if (by_pid == NULL)
+		{
+			return 1;
+		}
+		jobs.by_pid = by_pid;
+		jobs.pid_capacity = capacity;
+		for (size_t i = 0; i < old_capacity; i++)
+		{
+			if (old[i] != NULL)
+			{
+				*job_pid_slot(old[i]->pid) = old[i];
+			}
+		}
+		free(old);
+	}
+	return 0;
+}
+
+// Returns the by_pid slot holding pid, or the empty slot where it would be inserted.
+struct job_process **job_pid_slot(pid_t pid)
+{
+	size_t mask = jobs.pid_capacity - 1;
+	size_t i = ((uint32_t)pid * 2654435761u) & mask;
+	while (jobs.by_pid[i] != NULL && jobs.by_pid[i]->pid != pid)
+	{
+		i = (i + 1) & mask;
+	}
+	return &jobs.by_pid[i];
+}
+
+// Removes pid from by_pid, shifting later entries of its probe chain back so no tombstones are needed.
+void job_pid_remove(pid_t pid)
+{
+	size_t mask = jobs.pid_capacity - 1;
+	size_t hole = job_pid_slot(pid) - jobs.by_pid;
+
+	if (jobs.by_pid[hole] == NULL)
+	{
+		return;
+	}
+	jobs.by_pid[hole] = NULL;
+	jobs.pid_used--;
+	for (size_t i = (hole + 1) & mask; jobs.by_pid[i] != NULL; i = (i + 1) & mask)
+	{
+		size_t home = ((uint32_t)jobs.by_pid[i]->pid * 2654435761u) & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask))
+		{
+			jobs.by_pid[hole] = jobs.by_pid[i];
+			jobs.by_pid[i] = NULL;
+			hole = i;
+		}
+	}
+}
+
+struct job *job_by_id(int id)
+{
+	if (id < 1 || id > jobs.highest_id)
+	{
+		return NULL;
+	}
+	return jobs.by_id[id - 1];
+}
+
+// Takes a reaped process out of its job, adding its status and resource usage. The job is done
+// with its last process.
+void job_reaped(struct job_process *process, int status, const struct rusage *usage)
+{
+	struct job *job = process->job;
+	struct job_process **link = &job->processes;
+	struct command_record record;
+	char *argv[] = {job->command, NULL};
+
+	add_usage(&job->usage, usage);
+	if (process->pid == job->last_pid)
+	{
+		job->status = status;
+	}
+	trace_process_end(process->pid, status);
+	stats_log_reaped(process->pid, status, usage);
+	timeout_untrack(process->pid);
+	if (process->pidfd != -1)
+	{
+		epoll_ctl(jobs.epoll_fd, EPOLL_CTL_DEL, process->pidfd, NULL);
+		close(process->pidfd);
+	}
+	else
+	{
+		jobs.unwatched--;
+	}
+	// The pid is free for reuse from now on
+	job_pid_remove(process->pid);
+	while (*link != process)
+	{
+		link = &(*link)->next;
+	}
+	*link = process->next;
+	free(process);
+	if (job->processes != NULL)
+	{
+		return;
+	}
+
+	if (job->state == JOB_STOPPED)
+	{
+		jobs.stopped--;
+	}
+	job->state = JOB_DONE;
+	record_start(&record, 1, argv);
+	record.started = job->started;
+	record_process(&record, job->status, &job->usage);
+	record_finish(&record);
+	jobs.running--;
+}
+
+// Forgets a finished job once its status has been reported.
+void job_remove(struct job *job)
+{
+	jobs.by_id[job->id - 1] = NULL;
+	while (jobs.highest_id > 0 && jobs.by_id[jobs.highest_id - 1] == NULL)
+	{
+		jobs.highest_id--;
+	}
+	while (job->processes != NULL)
+	{
+		// Only when the shell exits - the processes are left to run on
+		struct job_process *process = job->processes;
+		job->processes = process->next;
+		if (process->pidfd != -1)
+		{
+			close(process->pidfd);
+		}
+		free(process);
+	}
+	free(job->command);
+	free(job->argv);
+	free(job->heredocs.bodies);
+	free(job);
+}
+
+// Reaps every background job that has exited. Waits up to timeout_ms (-1 - forever) for the
+// first one if none has exited yet. Each exited job is found through its epoll event, never by
+// scanning the table. Queued jobs are started afterwards, as far as processes allow.
+void reap_jobs(int timeout_ms)
+{
+	struct epoll_event events[REAP_BATCH];
+	struct rusage usage;
+	siginfo_t info;
+	int n, status;
+	pid_t pid;
+
+	if (jobs.running == 0 && jobs.unwatched == 0)
+	{
+		if (jobs.queued > 0)
+		{
+			// Only other processes can free what the queue waits for, so back off before trying
+			if (timeout_ms != 0)
+			{
+				spawn_backoff(timeout_ms < 0 || timeout_ms > SPAWN_BACKOFF_MAX_MS ? SPAWN_BACKOFF_MAX_MS : timeout_ms);
+			}
+			start_queued_jobs();
+			if (timeout_ms != 0 && jobs.running == 0 && jobs.queued > 0 && ++jobs.queue_stalls > SPAWN_RETRIES)
+			{
+				// None of our children is left to free a process - give up on the oldest job
+				errno = EAGAIN;
+				perror("Failed during forking");
+				job_dequeue();
+				spawn_pressure.refused++;
+				jobs.queue_stalls = 0;
+			}
+		}
+		return;
+	}
+	if (jobs.unwatched > 0)
+	{
+		// Some children have no pidfd. Peek at an exited child and reap it only if it is a job's:
+		// any other is a foreground child that wait_child is about to reap.
+		while (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid > 0)
+		{
+			struct job_process *process = *job_pid_slot(info.si_pid);
+			if (process == NULL || wait4(info.si_pid, &status, WNOHANG, &usage) != info.si_pid)
+			{
+				break;
+			}
+			job_reaped(process, status, &usage);
+		}
+		for (int i = 0; i < jobs.untracked_count; i++)
+		{
+			pid = wait4(jobs.untracked[i], &status, WNOHANG, NULL);
+			if (pid == jobs.untracked[i] || (pid == -1 && errno == ECHILD))
+			{
+				jobs.untracked[i--] = jobs.untracked[--jobs.untracked_count];
+				jobs.unwatched--;
+			}
+		}
+		if (jobs.unwatched > 0 && (timeout_ms < 0 || timeout_ms > UNWATCHED_POLL_MS))
+		{
+			// Nothing wakes us up for those, so poll
+			timeout_ms = UNWATCHED_POLL_MS;
+		}
+	}
+	if (timeout_ms != 0 && timeouts != NULL)
+	{
+		// Deadlines have to expire while we wait - wait in the event loop, which reaps too
+		run_events(-1, timeout_ms);
+		timeout_ms = 0;
+	}
+	do
+	{
+		n = epoll_wait(jobs.epoll_fd, events, REAP_BATCH, jobs.pid_used > (size_t)jobs.unwatched ? timeout_ms : 0);
+		for (int i = 0; i < n; i++)
+		{
+			struct job_process *process = events[i].data.ptr;
+			if (wait4(process->pid, &status, WNOHANG, &usage) == process->pid)
+			{
+				job_reaped(process, status, &usage);
+			}
+		}
+		timeout_ms = 0;
+	} while (n == REAP_BATCH);
+	if (jobs.queued > 0)
+	{
+		start_queued_jobs();
+	}
+}
+
+void print_job(const struct job *job)
+{
+	char state[32];
+
+	if (job->state == JOB_QUEUED)
+	{
+		printf("[%d]  Queued\t-\t%s\n", job->id, job->command);
+		return;
+	}
+	if (job->state == JOB_RUNNING || job->state == JOB_STOPPED)
+	{
+		printf("[%d]  %s\t%d\t%s\n", job->id, job->state == JOB_RUNNING ? "Running" : "Stopped", (int)job->pgid, job->command);
+		return;
+	}
+	if (WIFSIGNALED(job->status))
+	{
+		snprintf(state, sizeof(state), "Signal(%d)", WTERMSIG(job->status));
+	}
+	else
+	{
+		snprintf(state, sizeof(state), "Done(%d)", WEXITSTATUS(job->status));
+	}
+	printf("[%d]  %s\t%d\t%s\t(%ld.%03lds user, %ld.%03lds sys, %ld KB max RSS)\n", job->id, state,
+		   (int)job->pgid, job->command, (long)job->usage.ru_utime.tv_sec, (long)job->usage.ru_utime.tv_usec / 1000,
+		   (long)job->usage.ru_stime.tv_sec, (long)job->usage.ru_stime.tv_usec / 1000, job->usage.ru_maxrss);
+}
+
+// Parses a job id written as "n" or "%n". Returns -1 if word is not one.
+int parse_job_id(const char *word)
+{
+	char *end;
+	long id;
+
+	if (word[0] == '%')
+	{
+		word++;
+	}
+	errno = 0;
+	id = strtol(word, &end, 10);
+	if (word[0] == '\0' || *end != '\0' || errno != 0 || id < 1 || id > INT_MAX)
+	{
+		return -1;
+	}
+	return (int)id;
+}
+
+// jobs - list background jobs; finished ones are listed once, with their status and usage
+int builtin_jobs(int count, char **arglist)
+{
+	(void)count;
+	(void)arglist;
+	reap_jobs(0);
+	for (int id = 1; id <= jobs.highest_id; id++)
+	{
+		struct job *job = jobs.by_id[id - 1];
+		if (job == NULL)
+		{
+			continue;
+		}
+		print_job(job);
+		if (job->state == JOB_DONE)
+		{
+			job_remove(job);
+		}
+	}
+	fflush(stdout);
+	return 1;
+}
+
+// wait          - wait for every background job
+// wait id ...   - wait for the given jobs ("n" or "%n") and print how they finished
+int builtin_wait(int count, char **arglist)
+{
+	if (count == 1)
+	{
+		// Suspended jobs would never finish, so they are not waited for (or forgotten)
+		while (jobs.running > jobs.stopped || (jobs.unwatched > 0 && jobs.stopped == 0) || jobs.queued > 0)
+		{
+			reap_jobs(-1);
+		}
+		for (int id = jobs.highest_id; id >= 1; id--)
+		{
+			if (jobs.by_id[id - 1] != NULL && jobs.by_id[id - 1]->state == JOB_DONE)
+			{
+				job_remove(jobs.by_id[id - 1]);
+			}
+		}
+		return 1;
+	}
+	for (int i = 1; i < count; i++)
+	{
+		struct job *job = job_by_id(parse_job_id(arglist[i]));
+		if (job == NULL)
+		{
+			fprintf(stderr, "wait: %s: no such job\n", arglist[i]);
+			continue;
+		}
+		while (job->state != JOB_DONE && job->state != JOB_STOPPED)
+		{
+			reap_jobs(-1);
+		}
+		print_job(job);
+		if (job->state == JOB_DONE)
+		{
+			job_remove(job);
+		}
+	}
+	fflush(stdout);
+	return 1;
+}
+
+// Whether any process of job is stopped right now.
+int job_is_stopped(const struct job *job)
+{
+	siginfo_t info;
+
+	info.si_pid = 0;
+	return waitid(P_PGID, job->pgid, &info, WSTOPPED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0;
+}
+
+// Continues a running or suspended job's processes.
+void job_continue(struct job *job)
+{
+	if (job->state == JOB_STOPPED)
+	{
+		job->state = JOB_RUNNING;
+		jobs.stopped--;
+	}
+	killpg(job->pgid, SIGCONT);
+}
+
+// The job a fg or bg command line names ("n" or "%n"), or without one the newest started job, a
+// suspended one first. Returns NULL (after reporting) if there is none.
+struct job *job_argument(int count, char **arglist, const char *builtin)
+{
+	struct job *job = NULL;
+
+	if (count > 1)
+	{
+		job = job_by_id(parse_job_id(arglist[1]));
+		if (job == NULL || job->state == JOB_DONE)
+		{
+			fprintf(stderr, "%s: %s: no such job\n", builtin, arglist[1]);
+			return NULL;
+		}
+		if (job->state == JOB_QUEUED)
+		{
+			fprintf(stderr, "%s: %s: job has not started yet\n", builtin, arglist[1]);
+			return NULL;
+		}
+		return job;
+	}
+	for (int id = jobs.highest_id; id >= 1; id--)
+	{
+		struct job *candidate = jobs.by_id[id - 1];
+		if (candidate != NULL && (candidate->state == JOB_STOPPED || (candidate->state == JOB_RUNNING && job == NULL)))
+		{
+			job = candidate;
+			if (job->state == JOB_STOPPED)
+			{
+				break;
+			}
+		}
+	}
+	if (job == NULL)
+	{
+		fprintf(stderr, "%s: no current job\n", builtin);
+	}
+	return job;
+}
+
+// fg [id] - continue a job in the foreground (with the terminal) and wait until it finishes or is
+//           suspended again
+int builtin_fg(int count, char **arglist)
+{
+	struct job *job = job_argument(count, arglist, "fg");
+
+	if (job == NULL)
+	{
+		return 1;
+	}
+	printf("%s\n", job->command);
+	fflush(stdout);
+	// It is this line's foreground group now: it gets the terminal (taken back when the line
+	// ends) or, without one, the SIGINTs the shell receives
+	line_group = (struct line_group){.pgid = job->pgid, .foreground = 1, .has_terminal = terminal.fd != -1};
+	if (terminal.fd != -1)
+	{
+		tcsetpgrp(terminal.fd, job->pgid);
+	}
+	job_continue(job);
+	while (job->state == JOB_RUNNING)
+	{
+		if (job_is_stopped(job))
+		{
+			job->state = JOB_STOPPED;
+			jobs.stopped++;
+			printf("\n[%d]+  Stopped\t%s\n", job->id, job->command);
+			fflush(stdout);
+			break;
+		}
+		// Exits and stops both raise SIGCHLD
+		run_events(-1, -1);
+	}
+	if (job->state == JOB_DONE)
+	{
+		job_remove(job);
+	}
+	return 1;
+}
+
+// bg [id] - continue a suspended job in the background
+int builtin_bg(int count, char **arglist)
+{
+	struct job *job = job_argument(count, arglist, "bg");
+
+	if (job == NULL)
+	{
+		return 1;
+	}
+	// A running job may also have been stopped by a signal from outside (kill -STOP)
+	if (job->state == JOB_RUNNING && !job_is_stopped(job))
+	{
+		fprintf(stderr, "bg: job %d already in background\n", job->id);
+		return 1;
+	}
+	job_continue(job);
+	printf("[%d]+  %s &\n", job->id, job->command);
+	fflush(stdout);
+	return 1;
+}
+
+// Parses a signal given as a number or a name ("TERM", "SIGTERM"). Returns -1 if word is neither.
+int parse_signal(const char *word)
+{
+	static const struct
+	{
+		const char *name;
+		int number;
+	} names[] = {{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+				 {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CHLD", SIGCHLD},
+				 {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}};
+	char *end;
+	long number;
+
+	if (isdigit((unsigned char)word[0]))
 	{
-		return execute_general(count, arglist);
+		number = strtol(word, &end, 10);
+		return *end == '\0' && number < NSIG ? (int)number : -1;
 	}
-	for (int i = 0; i < count; i++)
+	if (strncasecmp(word, "SIG", 3) == 0)
 	{
-		if (strcmp(arglist[i], "|") == 0)
+		word += 3;
+	}
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+	{
+		if (strcasecmp(word, names[i].name) == 0)
 		{
-			// run two child processes, with the output of the first process piped to the input of the second process.
-			return pipe_it_up(count, arglist, i);
+			return names[i].number;
 		}
+	}
+	return -1;
+}
 
-		if (strcmp(arglist[i], "&") == 0)
+// kill [-SIG | -s SIG] target ... - send a signal (TERM by default) to jobs ("%n" - every process
+//                                   of the job with one killpg) or to pids
+int builtin_kill(int count, char **arglist)
+{
+	int sig = SIGTERM, i = 1;
+
+	if (count > 2 && strcmp(arglist[1], "-s") == 0)
+	{
+		sig = parse_signal(arglist[2]);
+		i = 3;
+	}
+	else if (count > 1 && arglist[1][0] == '-' && arglist[1][1] != '\0')
+	{
+		sig = parse_signal(arglist[1] + 1);
+		i = 2;
+	}
+	if (sig < 0)
+	{
+		fprintf(stderr, "kill: %s: invalid signal\n", arglist[i - 1]);
+		return 1;
+	}
+	if (i == count)
+	{
+		fprintf(stderr, "usage: kill [-SIG | -s SIG] %%id | pid ...\n");
+		return 1;
+	}
+	for (; i < count; i++)
+	{
+		if (arglist[i][0] == '%')
 		{
-			// run the child process in the background
-			return run_process_background(count, arglist);
+			struct job *job = job_by_id(parse_job_id(arglist[i]));
+			if (job == NULL || job->state == JOB_DONE)
+			{
+				fprintf(stderr, "kill: %s: no such job\n", arglist[i]);
+			}
+			else if (job->state == JOB_QUEUED)
+			{
+				// Never started - a signal that would end it just takes it out of the queue
+				if (sig != 0 && sig != SIGCHLD && sig != SIGCONT && sig != SIGSTOP && sig != SIGTSTP && sig != SIGTTIN && sig != SIGTTOU)
+				{
+					job_drop_queued(job, sig);
+				}
+			}
+			else if (killpg(job->pgid, sig) == -1)
+			{
+				perror("kill");
+			}
+			else if ((job->state == JOB_STOPPED || job_is_stopped(job)) && (sig == SIGTERM || sig == SIGHUP || sig == SIGINT))
+			{
+				// A stopped process would only act on it once continued
+				job_continue(job);
+			}
 		}
-
-		if (count >= 2 && (strcmp(arglist[i], "<") == 0))
+		else
 		{
-			// open the specified file and then run the child process, with the input redirected from the input file.
-			return open_child_process_input(count, arglist);
+			char *end;
+			long pid = strtol(arglist[i], &end, 10);
+			if (arglist[i][0] == '\0' || *end != '\0' || pid <= 0 || pid > INT_MAX)
+			{
+				fprintf(stderr, "kill: %s: not a pid or job\n", arglist[i]);
+			}
+			else if (kill((pid_t)pid, sig) == -1)
+			{
+				perror("kill");
+			}
 		}
+	}
+	return 1;
+}
 
-		if (count > 1 && (strcmp(arglist[i], ">>") == 0))
+// Returns the builtin called name, or NULL if name is not one (or is forced external).
+const struct builtin *find_builtin(const char *name)
+{
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+	{
+		if (strcmp(builtins[i].name, name) == 0)
 		{
-			// open the specified file and then run the child process, with the output redirected from the output file.
-			return open_child_process_output(count, arglist);
+			if (builtins[i].has_binary && !builtins_in_process)
+			{
+				return NULL;
+			}
+			return &builtins[i];
 		}
 	}
-	return execute_general(count, arglist);
+	return NULL;
 }
 
-int run_process_background(int count, char **arglist)
+// Runs a builtin inside the shell. fds are where its fds 0-2 go (-1 - nowhere else); the shell's
+// own fds are pointed at them for the duration and restored afterwards.
+int run_builtin(const struct builtin *builtin, char **argv, const int fds[3])
 {
-	pid_t pid;
-	pid = fork();
-	if (pid == -1)
+	int saved[3] = {-1, -1, -1}, redirected[3] = {0}, count, ret = 1, ok = 1;
+
+	for (count = 0; argv[count] != NULL; count++)
 	{
-		raise_error("Failed during forking");
 	}
-	if (pid == 0)
+	fflush(stdout);
+	// In fd order, like the child's dup2s
+	for (int fd = 0; fd < 3 && ok; fd++)
 	{
-		// Child process
-		if (handle_signal(SIGCHLD, SIG_DFL) == 1)
+		if (fds[fd] == -1)
 		{
-			raise_error("Error - Could not change signal handling");
+			continue;
 		}
-		arglist[count - 1] = NULL;
-		if (execvp(arglist[0], arglist) == -1)
+		saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+		ok = redirected[fd] = dup2(fds[fd], fd) != -1;
+		if (!ok)
 		{
-			raise_error("Error - Could not execute child process");
+			perror("Error - Could not redirect builtin");
 		}
 	}
-	return 1;
-}
-
-int pipe_it_up(int count, char **arglist, int i)
-{
-
-	pid_t pid1, pid2;
-	int pipefd[2];
-	if (pipe(pipefd) == -1)
+	if (ok)
 	{
-		perror("Error - could not create pipe");
-		return 0;
+		ret = builtin->run(count, argv);
 	}
 
-	pid1 = fork();
-	if (pid1 == -1)
+	fflush(stdout);
+	for (int fd = 0; fd < 3; fd++)
 	{
-		perror("Failed during forking");
-		return 0;
+		if (saved[fd] != -1)
+		{
+			dup2(saved[fd], fd);
+			close(saved[fd]);
+		}
+		else if (redirected[fd])
+		{
+			// The shell had nothing open on fd before
+			close(fd);
+		}
 	}
-	// Child process - 1st child.
-	if (pid1 == 0)
-	{
+	return ret;
+}
 
-		close(pipefd[0]);
-		if (handle_signal(SIGINT, SIG_DFL) + handle_signal(SIGCHLD, SIG_DFL) > 0)
+// Writes all of buf to fd, retrying short writes. Returns 0 on success, -1 on failure.
+int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, buf, len);
+		if (n == -1)
 		{
-			raise_error("Error");
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
 		}
-		// Stdout to pipe
-		if (dup2(pipefd[1], STDOUT_FILENO) == -1)
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// echo [-neE] args... - like coreutils echo; the whole line goes out in a single write()
+int builtin_echo(int count, char **arglist)
+{
+	static char *buf = NULL;
+	static size_t buf_size = 0;
+	int newline = 1, escapes = 0, i = 1;
+	size_t need = 1, len = 0;
+
+	// Leading option words made only of n, e and E letters
+	for (; i < count && arglist[i][0] == '-' && arglist[i][1] != '\0'; i++)
+	{
+		if (strspn(arglist[i] + 1, "neE") != strlen(arglist[i] + 1))
 		{
-			raise_error("Error - Could not redirect stdout of child process");
+			break;
 		}
-		close(pipefd[1]);  // Close Write end
-		arglist[i] = NULL; // Split arglist
-		if (execvp(arglist[0], arglist) == -1)
+		for (const char *c = arglist[i] + 1; *c != '\0'; c++)
 		{
-			raise_error("Error - while executing command");
+			newline &= (*c != 'n');
+			escapes = (*c == 'e') ? 1 : (*c == 'E') ? 0 : escapes;
 		}
 	}
-
-	pid2 = fork();
-	if (pid2 == -1)
+	for (int j = i; j < count; j++)
 	{
-		perror("Failed during forking");
-		return 0;
+		need += strlen(arglist[j]) + 1;
 	}
-	// Child process - 2nd child.
-	if (pid2 == 0)
+	if (need > buf_size)
 	{
-
-		close(pipefd[1]);
-		if (handle_signal(SIGINT, SIG_DFL) + handle_signal(SIGCHLD, SIG_DFL) > 0)
+		char *grown = realloc(buf, need);
+		if (grown == NULL)
+		{
+			perror("echo");
+			return 1;
+		}
+		buf = grown;
+		buf_size = need;
+	}
+	for (int j = i; j < count; j++)
+	{
+		const char *c = arglist[j];
+		if (j > i)
 		{
-			raise_error("Error");
+			buf[len++] = ' ';
 		}
-		// Stdin to pipe
-		if (dup2(pipefd[0], STDIN_FILENO) == -1)
+		if (!escapes)
 		{
-			raise_error("Error - Could not redirect stdin of child process");
+			size_t word_len = strlen(c);
+			memcpy(buf + len, c, word_len);
+			len += word_len;
+			continue;
 		}
-		close(pipefd[0]); // Close Read end
-		if (execvp(arglist[i + 1], &arglist[i + 1]) == -1)
+		// Every escape sequence is at least as long as what it produces, so buf is big enough
+		for (; *c != '\0'; c++)
 		{
-			raise_error("Error - Could not complete executing command");
+			int value, digits;
+			if (*c != '\\' || c[1] == '\0')
+			{
+				buf[len++] = *c;
+				continue;
+			}
+			switch (*++c)
+			{
+			case 'a': buf[len++] = '\a'; break;
+			case 'b': buf[len++] = '\b'; break;
+			case 'e': buf[len++] = '\033'; break;
+			case 'f': buf[len++] = '\f'; break;
+			case 'n': buf[len++] = '\n'; break;
+			case 'r': buf[len++] = '\r'; break;
+			case 't': buf[len++] = '\t'; break;
+			case 'v': buf[len++] = '\v'; break;
+			case '\\': buf[len++] = '\\'; break;
+			case 'c':
+				// Stop output here, including the newline
+				write_all(STDOUT_FILENO, buf, len);
+				return 1;
+			case '0':
+				for (value = 0, digits = 0; digits < 3 && c[1] >= '0' && c[1] <= '7'; digits++)
+				{
+					value = value * 8 + (*++c - '0');
+				}
+				buf[len++] = (char)value;
+				break;
+			case 'x':
+				if (!isxdigit((unsigned char)c[1]))
+				{
+					buf[len++] = '\\';
+					buf[len++] = 'x';
+					break;
+				}
+				for (value = 0, digits = 0; digits < 2 && isxdigit((unsigned char)c[1]); digits++)
+				{
+					c++;
+					value = value * 16 + (isdigit((unsigned char)*c) ? *c - '0' : (tolower((unsigned char)*c) - 'a' + 10));
+				}
+				buf[len++] = (char)value;
+				break;
+			default:
+				buf[len++] = '\\';
+				buf[len++] = *c;
+				break;
+			}
 		}
 	}
-	// Close both ends of the pipe (parent)
-	close(pipefd[0]);
-	close(pipefd[1]);
-
-	// Wait for both child processes to finish
-	if (waitpid(pid1, NULL, 0) == -1 && errno != ECHILD && errno != EINTR)
+	if (newline)
 	{
-		perror("failure during waitpid");
-		return 0;
+		buf[len++] = '\n';
 	}
-	if (waitpid(pid2, NULL, 0) == -1 && errno != ECHILD && errno != EINTR)
+	if (write_all(STDOUT_FILENO, buf, len) == -1)
 	{
-		perror("failure during waitpid");
-		return 0;
+		perror("echo: write error");
 	}
+	return 1;
+}
 
+int builtin_true(int count, char **arglist)
+{
+	(void)count;
+	(void)arglist;
 	return 1;
 }
 
-int open_child_process_input(int count, char **arglist)
+int builtin_false(int count, char **arglist)
 {
-	// Input
-	pid_t pid;
-	int input_file;
-	arglist[count - 2] = NULL;
-	pid = fork();
-	if (pid == -1)
+	// Statuses are recorded per reaped process and a builtin has none, so false only differs from
+	// true by name - MYSHELL_BUILTINS=0 runs the real one
+	(void)count;
+	(void)arglist;
+	return 1;
+}
+
+// cd [dir | -] - change the shell's directory (default $HOME) and update PWD/OLDPWD
+int builtin_cd(int count, char **arglist)
+{
+	const char *dir = count > 1 ? arglist[1] : getenv("HOME");
+	char *old = getcwd(NULL, 0);
+	char *now;
+
+	if (count > 1 && strcmp(dir, "-") == 0)
 	{
-		raise_error("Failed during forking");
+		dir = getenv("OLDPWD");
+		if (dir == NULL)
+		{
+			fprintf(stderr, "cd: OLDPWD not set\n");
+			free(old);
+			return 1;
+		}
 	}
-	// Child process
-	if (pid == 0)
+	if (dir == NULL)
 	{
-
-		if ((handle_signal(SIGINT, SIG_DFL) + handle_signal(SIGCHLD, SIG_DFL) > 0))
+		fprintf(stderr, "cd: HOME not set\n");
+		free(old);
+		return 1;
+	}
+	if (chdir(dir) == -1)
+	{
+		fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+		free(old);
+		return 1;
+	}
+	if (old != NULL)
+	{
+		setenv("OLDPWD", old, 1);
+		free(old);
+	}
+	if ((now = getcwd(NULL, 0)) != NULL)
+	{
+		if (count > 1 && strcmp(arglist[1], "-") == 0)
 		{
-			raise_error("Error - Could not change signal handling");
+			// Like other shells, "cd -" says where it went
+			printf("%s\n", now);
+			fflush(stdout);
 		}
+		setenv("PWD", now, 1);
+		free(now);
+	}
+	return 1;
+}
 
-		input_file = open(arglist[count - 1], O_RDONLY);
-		if (input_file == -1)
-		{
-			raise_error("Error - Could not open the file descriptor - input");
-		}
+int builtin_pwd(int count, char **arglist)
+{
+	char *cwd = getcwd(NULL, 0);
+	(void)count;
+	(void)arglist;
+	if (cwd == NULL)
+	{
+		perror("pwd");
+		return 1;
+	}
+	printf("%s\n", cwd);
+	fflush(stdout);
+	free(cwd);
+	return 1;
+}
 
-		if (dup2(input_file, STDIN_FILENO) < 0)
-		{
-			raise_error("Error - Could not reference the stdin to the file descriptor");
-		}
+// exit [n] - leave the shell, with status n if given
+int builtin_exit(int count, char **arglist)
+{
+	if (count > 1)
+	{
+		int status = atoi(arglist[1]);
+		fflush(stdout);
+		exit(finalize() != 0 ? 1 : status);
+	}
+	return 0;
+}
 
-		close(input_file);
+void raise_error(const char *error_type)
+{
+	perror(error_type);
+	fprintf(stderr, "%s\n", strerror(errno));
+	exit(1);
+}
 
-		if (execvp(arglist[0], arglist) < 0)
-		{
-			raise_error("Error - failed closing the read end of the pipe - child process");
-		}
+void report_child_error(int status_fd)
+{
+	// Sends errno to the parent waiting in spawn_fork, which reports it. _exit skips stdio
+	// cleanup, which would otherwise flush the shell's buffered output twice and rewind a shared
+	// stdin.
+	int err = errno;
+	if (write(status_fd, &err, sizeof(err)) == -1)
+	{
+		perror("Error - Could not report the exec failure");
 	}
-	if ((waitpid(pid, NULL, 0) == -1) && (errno != EINTR) && (errno != ECHILD))
+	_exit(127);
+}
+
+int prepare(void)
+{
+	const char *backend = getenv("MYSHELL_SPAWN");
+	const char *builtins_env = getenv("MYSHELL_BUILTINS");
+	const char *slots_env = getenv("MYSHELL_JOB_SLOTS");
+	const char *stats_env = getenv("MYSHELL_STATS_LOG");
+	const char *trace_env = getenv("MYSHELL_TRACE");
+	if (backend != NULL && strcmp(backend, "fork") == 0)
 	{
-		perror("Error - failed waiting for children ");
-		return 0;
+		spawn_backend = SPAWN_BACKEND_FORK;
 	}
-	return 1;
+	if (builtins_env != NULL && strcmp(builtins_env, "0") == 0)
+	{
+		// Run echo, true, false and pwd as external programs (for comparison benchmarks)
+		builtins_in_process = 0;
+	}
+	// As many background jobs as processors run at once unless MYSHELL_JOB_SLOTS says otherwise
+	jobs.slots = slots_env != NULL ? atoi(slots_env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs.slots < 0)
+	{
+		jobs.slots = 1;
+	}
+	if (stats_env != NULL && stats_env[0] != '\0')
+	{
+		// Not fatal - the shell works the same without its statistics
+		stats_log_open(stats_env);
+	}
+	if (trace_env != NULL && trace_env[0] != '\0')
+	{
+		trace_open(trace_env);
+	}
+	jobs.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (jobs.epoll_fd == -1)
+	{
+		perror("Error - Could not create the job table");
+		return 1;
+	}
+	// SIGCHLD keeps its default action so exited children stay waitable: background jobs are
+	// reaped by the job table (which records their status) instead of by the kernel.
+	// SIGTTOU is ignored so the shell can take the terminal back from a foreground group
+	if (handle_signal(SIGINT, SIG_IGN) + handle_signal(SIGCHLD, SIG_DFL) + handle_signal(SIGTTOU, SIG_IGN) > 0)
+	{
+		return 1;
+	}
+	terminal_open();
+	return events_open();
 }
 
-int open_child_process_output(int count, char **arglist)
+// Sets up the event loop: SIGCHLD and SIGINT are blocked and read from a signalfd instead.
+// SIGINT stays ignored as well, which is fine - a blocked signal is still queued for the signalfd
+// even when ignored. Returns 0 on success, 1 otherwise.
+int events_open(void)
 {
-	// Output
-	pid_t pid;
-	int output_file;
-	arglist[count - 2] = NULL;
-	pid = fork();
-	if (pid == -1)
+	struct epoll_event event = {.events = EPOLLIN};
+	sigset_t signals;
+
+	events.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (events.epoll_fd == -1)
 	{
-		raise_error("Failed during forking");
+		perror("Error - Could not create the event loop");
+		return 1;
 	}
-	// Child process
-	if (pid == 0)
+	event.data.fd = jobs.epoll_fd;
+	if (epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, jobs.epoll_fd, &event) == -1)
+	{
+		perror("Error - Could not create the event loop");
+		return 1;
+	}
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigaddset(&signals, SIGINT);
+	if (sigprocmask(SIG_BLOCK, &signals, NULL) == -1 ||
+		(events.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+	{
+		perror("Error - Could not create the event loop");
+		return 1;
+	}
+	event.data.fd = events.signal_fd;
+	if (epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, events.signal_fd, &event) == -1)
 	{
+		perror("Error - Could not create the event loop");
+		return 1;
+	}
+	return 0;
+}
 
-		if (handle_signal(SIGINT, SIG_DFL) + handle_signal(SIGCHLD, SIG_DFL) > 0)
-		{
-			raise_error("Error - Could not change signal handling");
-		}
+// Handles the events that arrive within timeout_ms (0 - only those already pending, -1 - waits
+// for the first). Returns 1 if fd (one the caller added to the set) became readable, 0 otherwise.
+int run_events(int fd, int timeout_ms)
+{
+	struct epoll_event ready[EVENT_BATCH];
+	struct signalfd_siginfo info;
+	int n, reap = 0, found = 0;
 
-		output_file = open(arglist[count - 1], O_WRONLY | O_CREAT | O_TRUNC, 0777);
-		if (output_file == -1)
+	do
+	{
+		n = epoll_wait(events.epoll_fd, ready, EVENT_BATCH, timeout_ms);
+		for (int i = 0; i < n; i++)
 		{
-			raise_error("Error - Could not open the file descriptor - output");
+			if (ready[i].data.fd == events.signal_fd)
+			{
+				while (read(events.signal_fd, &info, sizeof(info)) == sizeof(info))
+				{
+					if (info.ssi_signo == SIGCHLD)
+					{
+						siginfo_t stopped;
+						reap = 1;
+						if (line_group.relaying && info.ssi_code == CLD_STOPPED &&
+							waitid(P_PGID, line_group.pgid, &stopped, WSTOPPED | WNOHANG | WNOWAIT) == 0 && stopped.si_pid != 0)
+						{
+							// The relay runs in the shell and cannot be parked with the stages
+							fprintf(stderr, "Error - a pipeline with |N| or |& cannot be suspended\n");
+							killpg(line_group.pgid, SIGCONT);
+						}
+					}
+					else
+					{
+						events.interrupts++;
+						if (line_group.foreground && line_group.pgid != 0)
+						{
+							// Without a terminal to deliver it, pass it on to the foreground line
+							killpg(line_group.pgid, SIGINT);
+						}
+					}
+				}
+			}
+			else if (ready[i].data.fd == jobs.epoll_fd)
+			{
+				reap = 1;
+			}
+			else if (ready[i].data.fd == fd)
+			{
+				found = 1;
+			}
+			else
+			{
+				for (struct timeout *timeout = timeouts; timeout != NULL; timeout = timeout->next)
+				{
+					if (ready[i].data.fd == timeout->fd)
+					{
+						timeout_expire(timeout);
+						break;
+					}
+				}
+			}
 		}
+		timeout_ms = 0;
+	} while (n == EVENT_BATCH);
+	if (reap)
+	{
+		reap_jobs(0);
+	}
+	return found;
+}
 
-		if (dup2(output_file, STDOUT_FILENO) == -1)
-		{
-			raise_error("Error - Could not reference the stdout to the file descriptor");
-		}
+// The fd shell.c polls with stdin; handle_events runs whatever made it readable.
+int event_fd(void)
+{
+	return events.epoll_fd;
+}
+
+int handle_events(void)
+{
+	run_events(-1, 0);
+	return 0;
+}
+
+// Whether waiting should go through the event loop: something besides the awaited process needs
+// the shell's attention meanwhile. Without a terminal that includes a SIGINT for the foreground
+// line, which only the shell can pass on to its group.
+int events_wanted(void)
+{
+	return events.epoll_fd != -1 && (jobs.running > 0 || jobs.queued > 0 || timeouts != NULL || line_group.relaying ||
+									 (line_group.foreground && terminal.fd == -1));
+}
+
+// Checks whether the shell runs interactively in the foreground of its terminal - only then does
+// it hand the terminal to foreground groups.
+void terminal_open(void)
+{
+	terminal.shell_group = getpgrp();
+	if (isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == terminal.shell_group)
+	{
+		terminal.fd = STDIN_FILENO;
+		// Ctrl-Z suspends the foreground line, never the shell
+		handle_signal(SIGTSTP, SIG_IGN);
+		handle_signal(SIGTTIN, SIG_IGN);
+	}
+}
+
+// The line's processes are all started and waited for (or in the background) - the next line
+// starts a new group, and the shell takes the terminal back.
+void line_group_end(void)
+{
+	if (line_group.has_terminal)
+	{
+		tcsetpgrp(terminal.fd, terminal.shell_group);
+	}
+	line_group = (struct line_group){0};
+}
 
-		close(output_file);
+// Blocks until fd is ready for what (POLLIN or POLLOUT), handling the shell's events meanwhile.
+// Returns 0, or -1 with errno set if polling failed.
+int await_fd(int fd, short what)
+{
+	struct pollfd fds[2] = {{fd, what, 0}, {events.epoll_fd, POLLIN, 0}};
 
-		if (execvp(arglist[0], arglist) < 0)
+	while (events_wanted())
+	{
+		if (poll(fds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		if (fds[0].revents != 0)
 		{
-			raise_error("Error - failed closing the read end of the pipe - child process");
+			break;
 		}
+		run_events(-1, 0);
 	}
-	if ((waitpid(pid, NULL, 0) == -1) && (errno != ECHILD) && (errno != EINTR))
+	return 0;
+}
+
+// timeout <secs> cmd ... - stop the command line (every process of it, in the background too)
+// if it runs longer than secs seconds: SIGTERM, then SIGKILL if that is not enough
+int prefix_timeout(char **args)
+{
+	char *end;
+	double seconds = strtod(args[0], &end);
+
+	if (end == args[0] || *end != '\0' || !(seconds > 0) || seconds > 1e9)
 	{
-		perror("Error - failed waiting for children ");
-		return 0;
+		fprintf(stderr, "timeout: invalid duration %s\n", args[0]);
+		return 1;
 	}
-	return 1;
+	line_options.timeout = seconds;
+	return 0;
 }
 
-int execute_general(int count, char **arglist)
+// Arms a deadline seconds from now for command. Returns it with the caller as its one user,
+// or NULL (after reporting) if it could not be set - the command then runs without one.
+struct timeout *timeout_start(double seconds, const char *command)
 {
-	// Executes command and starts another one only after it is completed.
-	pid_t pid = fork();
-	if (pid == -1)
+	struct timeout *timeout = calloc(1, sizeof(struct timeout));
+	struct itimerspec when = {.it_value = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)}};
+	struct epoll_event event = {.events = EPOLLIN};
+
+	if (timeout == NULL)
 	{
-		raise_error("Failed during forking");
+		perror("Error - Could not set the timeout");
+		return NULL;
 	}
-	// Child process
-	if (pid == 0)
+	if (when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0)
 	{
-
-		if (handle_signal(SIGINT, SIG_DFL) + handle_signal(SIGCHLD, SIG_DFL) > 0)
+		when.it_value.tv_nsec = 1; // all zero would disarm it
+	}
+	timeout->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	event.data.fd = timeout->fd;
+	if (timeout->fd == -1 || timerfd_settime(timeout->fd, 0, &when, NULL) == -1 ||
+		epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, timeout->fd, &event) == -1)
+	{
+		perror("Error - Could not set the timeout");
+		if (timeout->fd != -1)
 		{
-			raise_error("Error - Could not change signal handling");
+			close(timeout->fd);
 		}
+		free(timeout);
+		return NULL;
+	}
+	timeout->seconds = seconds;
+	snprintf(timeout->command, sizeof(timeout->command), "%s", command);
+	timeout->users = 1;
+	timeout->next = timeouts;
+	timeouts = timeout;
+	return timeout;
+}
 
-		if (execvp(arglist[0], arglist) == -1)
+// Puts pid under timeout - right away if the deadline already passed.
+void timeout_track(struct timeout *timeout, pid_t pid)
+{
+	if (timeout->count == timeout->capacity)
+	{
+		int capacity = timeout->capacity == 0 ? 4 : timeout->capacity * 2;
+		pid_t *grown = realloc(timeout->pids, sizeof(pid_t) * capacity);
+		pid_t *grown_groups = grown == NULL ? NULL : realloc(timeout->pgids, sizeof(pid_t) * capacity);
+		if (grown_groups == NULL)
 		{
-			raise_error("Error - Could not execute child process");
+			perror("Error - Could not apply the timeout");
+			timeout->pids = grown != NULL ? grown : timeout->pids;
+			return;
 		}
+		timeout->pids = grown;
+		timeout->pgids = grown_groups;
+		timeout->capacity = capacity;
 	}
-	if ((waitpid(pid, NULL, 0) < 0) && ((errno != ECHILD) && (errno != EINTR)))
+	timeout->pids[timeout->count] = pid;
+	timeout->pgids[timeout->count++] = line_group.pgid;
+	timeout->users++;
+	if (timeout->signal != 0)
 	{
-		raise_error("Error - failed waiting for children ");
+		killpg(line_group.pgid, timeout->signal);
 	}
+}
 
-	return 1;
+// Takes a reaped pid out of the deadline it was under, if any.
+void timeout_untrack(pid_t pid)
+{
+	for (struct timeout *timeout = timeouts; timeout != NULL; timeout = timeout->next)
+	{
+		for (int i = 0; i < timeout->count; i++)
+		{
+			if (timeout->pids[i] == pid)
+			{
+				timeout->count--;
+				timeout->pids[i] = timeout->pids[timeout->count];
+				timeout->pgids[i] = timeout->pgids[timeout->count];
+				timeout_release(timeout);
+				return;
+			}
+		}
+	}
 }
 
-void raise_error(const char *error_type)
+// Drops one user of timeout, disarming and freeing it after the last.
+void timeout_release(struct timeout *timeout)
 {
-	perror(error_type);
-	fprintf(stderr, "%s\n", strerror(errno));
-	exit(1);
+	struct timeout **link = &timeouts;
+
+	if (--timeout->users > 0)
+	{
+		return;
+	}
+	while (*link != timeout)
+	{
+		link = &(*link)->next;
+	}
+	*link = timeout->next;
+	close(timeout->fd); // which also takes it out of the event loop
+	free(timeout->pids);
+	free(timeout->pgids);
+	free(timeout);
 }
 
-int prepare(void)
+// The deadline (or the grace period after SIGTERM) is over.
+void timeout_expire(struct timeout *timeout)
 {
+	struct itimerspec grace = {.it_value = {TIMEOUT_KILL_DELAY_MS / 1000, (TIMEOUT_KILL_DELAY_MS % 1000) * 1000000L}};
+	uint64_t expirations;
+
+	if (read(timeout->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+	{
+		return;
+	}
+	if (timeout->signal == 0)
+	{
+		fprintf(stderr, "timeout: %s: timed out after %gs\n", timeout->command, timeout->seconds);
+		timeout->signal = SIGTERM;
+		timerfd_settime(timeout->fd, 0, &grace, NULL);
+	}
+	else
+	{
+		timeout->signal = SIGKILL;
+	}
+	// A group is signalled while one of its processes is not reaped, so its id cannot have been
+	// reused. A line's processes are one group, so this is usually a single killpg.
+	for (int i = 0; i < timeout->count; i++)
+	{
+		int signalled = 0;
+		for (int j = 0; j < i && !signalled; j++)
+		{
+			signalled = timeout->pgids[j] == timeout->pgids[i];
+		}
+		if (!signalled)
+		{
+			killpg(timeout->pgids[i], timeout->signal);
+		}
+	}
+}
 
-	return handle_signal(SIGINT, SIG_IGN) + handle_signal(SIGCHLD, SIG_IGN);
+void events_close(void)
+{
+	if (events.signal_fd != -1)
+	{
+		close(events.signal_fd);
+	}
+	if (events.epoll_fd != -1)
+	{
+		close(events.epoll_fd);
+	}
+	events = (struct event_loop){.epoll_fd = -1, .signal_fd = -1};
 }
 
 int handle_signal(int sig, void (*to_do)(int))
@@ -314,7 +5809,43 @@ int handle_signal(int sig, void (*to_do)(int))
 
 int finalize(void)
 {
-
+	// Running jobs are left to run on, but queued ones would need the shell to start them - waiting
+	// for slots could take forever, so they are dropped
+	if (jobs.queued > 0)
+	{
+		fprintf(stderr, "Dropped %d queued background job%s\n", jobs.queued, jobs.queued == 1 ? "" : "s");
+		while (jobs.queue_head != NULL)
+		{
+			job_drop_queued(jobs.queue_head, W_EXITCODE(1, 0));
+		}
+	}
+	path_cache_clear();
+	free(parsed_command.kinds);
+	free(redirect_plan.argv);
+	free(queued_job_plan.argv);
+	free(line_heredocs.bodies);
+	free(command_history.records);
+	stats_log_close();
+	trace_close();
+	for (int id = jobs.highest_id; id >= 1; id--)
+	{
+		struct job *job = jobs.by_id[id - 1];
+		if (job != NULL)
+		{
+			job_remove(job);
+		}
+	}
+	while (timeouts != NULL)
+	{
+		// Jobs still running are left to run on
+		timeouts->users = 1;
+		timeout_release(timeouts);
+	}
+	free(jobs.by_id);
+	free(jobs.by_pid);
+	free(jobs.untracked);
+	events_close();
+	close(jobs.epoll_fd);
 	return 0;
 }
 
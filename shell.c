@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 
 // arglist - a list of char* arguments (words) provided by the user
 // it contains count+1 items, where the last item (arglist[count]) and *only* the last is NULL
@@ -13,57 +15,305 @@ int process_arglist(int count, char **arglist);
 int prepare(void);
 int finalize(void);
 
+// Optional - an implementation with events of its own (exited background jobs, signals, timers)
+// returns a pollable fd for them from event_fd, and handle_events is called whenever it is
+// readable, both between lines and while the shell waits for input.
+int event_fd(void) __attribute__((weak));
+int handle_events(void) __attribute__((weak));
+
+// Optional - an implementation with here-documents ("<<WORD" or "<< WORD") gets the body of each
+// one in the line it is about to run: the input lines after that line, up to a line that is just
+// WORD, which are not run as commands. index is its position among the line's here-documents.
+// body points into the input buffer and is valid until process_arglist returns.
+void add_heredoc(int index, const char *body, size_t len) __attribute__((weak));
+
+static inline unsigned char is_delim(unsigned char c)
+{
+	return (c == ' ') | (c == '\t') | (c == '\n');
+}
+
+// Counts the words in line[0..len) - the positions where a delimiter is followed by a
+// non-delimiter. Each step only looks at two adjacent bytes, so the loop vectorizes.
+static size_t count_words(const char *line, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)line;
+	size_t words;
+
+	if (len == 0)
+	{
+		return 0;
+	}
+	words = is_delim(p[0]) ^ 1;
+	for (size_t i = 1; i < len; i++)
+	{
+		words += is_delim(p[i - 1]) & (is_delim(p[i]) ^ 1);
+	}
+	return words;
+}
+
+// Splits line in place at spaces, tabs and newlines (like strtok) into arglist, which must
+// have room for every word. Returns the number of words.
+static int split_words(char *line, size_t len, char **arglist)
+{
+	int count = 0;
+	int in_word = 0;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if (is_delim(line[i]))
+		{
+			line[i] = '\0';
+			in_word = 0;
+		}
+		else if (!in_word)
+		{
+			arglist[count++] = &line[i];
+			in_word = 1;
+		}
+	}
+	arglist[count] = NULL;
+	return count;
+}
+
+// Finds the bodies of the here-documents the line text[0..line_len) opens, in the input after it,
+// text[line_len..len). If report is set, each is handed to add_heredoc. Returns how many bytes
+// the bodies and their delimiter lines take, or -1 if they are not all in text yet (at_eof - the
+// input ends the last body instead).
+static ssize_t collect_heredocs(const char *text, size_t line_len, size_t len, int at_eof, int report)
+{
+	size_t pos = line_len, i = 0;
+	int index = 0;
+
+	if (memmem(text, line_len, "<<", 2) == NULL)
+	{
+		return 0;
+	}
+	while (i < line_len)
+	{
+		const char *delimiter;
+		size_t word, delimiter_len, body;
+
+		for (; i < line_len && is_delim(text[i]); i++)
+		{
+		}
+		for (word = i; i < line_len && !is_delim(text[i]); i++)
+		{
+		}
+		if (i - word < 2 || text[word] != '<' || text[word + 1] != '<' || (i - word > 2 && text[word + 2] == '<'))
+		{
+			continue;
+		}
+		delimiter = &text[word + 2];
+		if (i - word == 2)
+		{
+			// "<< WORD" - the delimiter is the next word
+			for (; i < line_len && is_delim(text[i]); i++)
+			{
+			}
+			for (delimiter = &text[i]; i < line_len && !is_delim(text[i]); i++)
+			{
+			}
+		}
+		delimiter_len = &text[i] - delimiter;
+		if (delimiter_len == 0)
+		{
+			// "<<" at the end of the line - no here-document, the implementation reports it
+			continue;
+		}
+		// The body runs up to the first line that is exactly the delimiter
+		for (body = pos;;)
+		{
+			const char *newline = memchr(text + pos, '\n', len - pos);
+			size_t end = newline != NULL ? (size_t)(newline - text) : len;
+			if (newline == NULL && !at_eof)
+			{
+				return -1;
+			}
+			if (end - pos == delimiter_len && memcmp(text + pos, delimiter, delimiter_len) == 0)
+			{
+				if (report)
+				{
+					add_heredoc(index, text + body, pos - body);
+				}
+				pos = end + (newline != NULL);
+				break;
+			}
+			if (newline == NULL)
+			{
+				// Delimited by the end of the input
+				if (report)
+				{
+					add_heredoc(index, text + body, len - body);
+				}
+				pos = len;
+				break;
+			}
+			pos = end + 1;
+		}
+		index++;
+	}
+	return pos - line_len;
+}
+
+// Runs the line line[0..len), growing arglist to fit its words.
+// RETURNS - what process_arglist returned (1 for an empty line)
+static int run_line(char *line, size_t len, char ***arglist, size_t *arglist_size)
+{
+	size_t words = count_words(line, len);
+	int count;
+
+	if (words + 1 > *arglist_size)
+	{
+		size_t new_size = *arglist_size == 0 ? 16 : *arglist_size;
+		while (new_size < words + 1)
+		{
+			new_size *= 2;
+		}
+		char **grown = (char **)realloc(*arglist, sizeof(char *) * new_size);
+		if (grown == NULL)
+		{
+			printf("realloc failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		*arglist = grown;
+		*arglist_size = new_size;
+	}
+	count = split_words(line, len, *arglist);
+
+	return count == 0 || process_arglist(count, *arglist);
+}
+
 int main(void)
 {
+	// Both buffers live for the whole session and only ever grow, so a line costs no
+	// allocation once they are big enough.
+	char *input = NULL;
+	size_t input_size = 0, start = 0, used = 0;
+	char **arglist = NULL;
+	size_t arglist_size = 0;
+	struct epoll_event event = {.events = EPOLLIN, .data.fd = STDIN_FILENO};
+	int epoll_fd, events = -1, stdin_ready = 0, running = 1, at_eof = 0;
+
 	if (prepare() != 0)
 		exit(1);
 
-	while (1)
+	// One epoll set waits for input and for the implementation's events at once
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1)
+	{
+		// A regular file (or /dev/null) cannot be polled - it is always ready
+		stdin_ready = 1;
+	}
+	if (epoll_fd != -1 && event_fd != NULL && handle_events != NULL && (events = event_fd()) != -1)
+	{
+		event.data.fd = events;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, events, &event) == -1)
+		{
+			events = -1;
+		}
+	}
+	if (epoll_fd == -1)
+	{
+		stdin_ready = 1;
+	}
+
+	while (running)
 	{
-		char **arglist = NULL;
-		char *line = NULL;
-		size_t size;
-		int count = 0;
+		char *newline;
+		ssize_t n;
 
-		if (getline(&line, &size, stdin) == -1)
+		// Run every complete line read so far
+		while (running && (newline = memchr(input + start, '\n', used - start)) != NULL)
+		{
+			size_t len = newline + 1 - (input + start);
+			ssize_t bodies = 0;
+			if (add_heredoc != NULL)
+			{
+				// A line waits until its here-documents are read too
+				if ((bodies = collect_heredocs(input + start, len, used - start, at_eof, 0)) == -1)
+				{
+					break;
+				}
+				collect_heredocs(input + start, len, used - start, at_eof, 1);
+			}
+			running = run_line(input + start, len, &arglist, &arglist_size);
+			start += len + bodies;
+		}
+		if (!running)
 		{
-			free(line);
 			break;
 		}
-
-		arglist = (char **)malloc(sizeof(char *));
-		if (arglist == NULL)
+		if (at_eof)
 		{
-			printf("malloc failed: %s\n", strerror(errno));
-			exit(1);
+			// The last line may have no newline - its last word ends at the end of the input, in
+			// the byte the reads keep free
+			if (used > start)
+			{
+				input[used] = '\0';
+				run_line(input + start, used - start, &arglist, &arglist_size);
+			}
+			break;
 		}
-		arglist[0] = strtok(line, " \t\n");
-
-		while (arglist[count] != NULL)
+		if (start > 0)
 		{
-			++count;
-			arglist = (char **)realloc(arglist, sizeof(char *) * (count + 1));
-			if (arglist == NULL)
+			memmove(input, input + start, used - start);
+			used -= start;
+			start = 0;
+		}
+		if (used + 1 >= input_size)
+		{
+			size_t new_size = input_size == 0 ? 4096 : input_size * 2;
+			char *grown = (char *)realloc(input, new_size);
+			if (grown == NULL)
 			{
 				printf("realloc failed: %s\n", strerror(errno));
 				exit(1);
 			}
-
-			arglist[count] = strtok(NULL, " \t\n");
+			input = grown;
+			input_size = new_size;
 		}
 
-		if (count != 0)
+		if (epoll_fd != -1)
 		{
-			if (!process_arglist(count, arglist))
+			struct epoll_event ready[2];
+			int count = epoll_wait(epoll_fd, ready, 2, stdin_ready ? 0 : -1);
+			int input_ready = stdin_ready;
+
+			for (int i = 0; i < count; i++)
 			{
-				free(line);
-				free(arglist);
-				break;
+				if (ready[i].data.fd == events)
+				{
+					handle_events();
+				}
+				else
+				{
+					input_ready = 1;
+				}
+			}
+			if (!input_ready)
+			{
+				continue;
 			}
 		}
+		// Only read once epoll says so - stdin stays blocking, as the children share it
+		n = read(STDIN_FILENO, input + used, input_size - used - 1);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			at_eof = 1;
+			continue;
+		}
+		used += n;
+	}
 
-		free(line);
-		free(arglist);
+	free(input);
+	free(arglist);
+	if (epoll_fd != -1)
+	{
+		close(epoll_fd);
 	}
 
 	if (finalize() != 0)
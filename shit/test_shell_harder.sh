@@ -55,4 +55,90 @@ run_test "echo Nested pipes | tr 'a-z' 'A-Z' | tr 'A-Z' 'a-z' | tr 'a-z' 'A-Z'"
 
 run_test "echo Multiple background processes 1 & echo Multiple background processes 2 &" ""
 
+# N-stage pipelines
+run_test "seq 1 10 | sort -rn | head -n 5 | tail -n 2 | tr 0-9 a-j | cat" "h
+g"
+run_test "echo x | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat | tr x y" "y"
+run_test "| cat" "Error - empty command in pipeline"
+
+# |N| shard relay - the copies' output is merged in any order unless 'o' keeps the input's
+run_test "seq 1 6 |2o| cat" "1
+2
+3
+4
+5
+6"
+run_test "seq 1 6 |3| cat | sort -n" "1
+2
+3
+4
+5
+6"
+run_test "seq 1 5 |2k| cat | sort -n | tail -n 1" "5"
+
+# |& fan-out - every consumer gets the whole output
+run_test "echo fan | tr a-z A-Z |& cat, cat" "FAN
+FAN"
+run_test "seq 1 100 |& wc -l, wc -l, wc -l" "100
+100
+100"
+
+# timeout - SIGTERM at the deadline, SIGKILL for a command that ignores it
+run_test "timeout 0.2 sleep 5
+echo after" "timeout: sleep 5: timed out after 0.2s
+after"
+printf 'trap "" TERM\nsleep 5\necho survived\n' > test_ignore_term.sh
+run_test "timeout 0.2 sh test_ignore_term.sh
+echo after" "timeout: sh test_ignore_term.sh: timed out after 0.2s
+after"
+
+# Job control - jobs, fg, bg, kill, wait
+run_test "sleep 0.2 &
+fg 1
+echo back" "sleep 0.2
+back"
+run_test "sleep 0.2 &
+bg 1" "bg: job 1 already in background"
+run_test "sleep 5 | sleep 5 &
+kill %1
+wait
+jobs
+echo killed" "killed"
+run_test "sleep 0.1 &
+kill %2" "kill: %2: no such job"
+
+# Several redirections per command, 2>&1, and redirections in a background pipeline
+run_test "cat < test_input.txt > test_redirect_output.txt 2> test_redirect_error.txt" ""
+run_test "cat test_redirect_output.txt test_redirect_error.txt" "This is a test file with input redirection."
+run_test "cat nosuch_file > test_redirect_output.txt 2>&1" ""
+run_test "cat test_redirect_output.txt" "cat: nosuch_file: No such file or directory"
+run_test "cat nosuch_file 2>&1 | wc -l" "1"
+run_test "echo background pipeline | tr a-z A-Z > test_redirect_output.txt &
+wait
+cat test_redirect_output.txt" "BACKGROUND PIPELINE"
+
+# Here-documents and here-strings
+run_test "cat <<EOF
+line one
+line two
+EOF
+echo after" "line one
+line two
+after"
+run_test "cat <<A | tr a-z A-Z
+shouted
+A" "SHOUTED"
+run_test "cat <<< here-string" "here-string"
+run_test "wc -c <<<abc" "4"
+
+# Command and process substitution
+run_test "echo \$(echo inner words) outer" "inner words outer"
+run_test "echo \$(seq 1 3 | tr -d 2)" "1 3"
+run_test "cat <(echo from a process)" "from a process"
+run_test "diff <(seq 1 3) <(seq 1 3)
+echo same" "same"
+run_test "echo into a process > >(tr a-z A-Z)
+echo after" "INTO A PROCESS
+after"
+
 echo "All tests completed."
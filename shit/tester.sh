@@ -42,6 +42,13 @@ run_test "Test background execution" \
          "echo Hello, World! &" \
          "Hello, World!"
 
+# Test a background operator with no command before it
+run_test "Test empty background command" \
+         "&
+& echo skipped
+echo still running" \
+         "still running"
+
 # Test pipe
 run_test "Test pipe" \
          "echo Hello, World! | cat" \